@@ -0,0 +1,108 @@
+/* Microbenchmark for the connection table.    Fills the table in steps
+     and times lookups at each size; a linear scan of the same table, as
+     the fixed-size table did it, is shown for comparison. */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "conn.h"
+
+#define LOOKUPS (1 << 20)
+#define KEYS 4096
+
+static int sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65000 };
+static int keys[KEYS];
+static volatile int sink;
+
+static int host_of(int k) { return k % 254 + 1; }
+static int link_of(int k) { return k / 254; }
+static uint32_t sock_of(int k) { return 1002 + 2 * k; }
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int scan_link(int host, int link) {
+    int i;
+    for(i = 0; i < connections; i++) {
+        if(connection[i].host == host && connection[i].rcv.link == link)
+            return i;
+        if(connection[i].host == host && connection[i].snd.link == link)
+            return i;
+    }
+    return -1;
+}
+
+static double time_rcv_link(int lookups) {
+    double start = now();
+    int i, k;
+    for(i = 0; i < lookups; i++) {
+        k = keys[i % KEYS];
+        sink = conn_find_rcv_link(host_of(k), link_of(k));
+    }
+    return (now() - start) / lookups;
+}
+
+static double time_snd_link(int lookups) {
+    double start = now();
+    int i, k;
+    for(i = 0; i < lookups; i++) {
+        k = keys[i % KEYS];
+        sink = conn_find_snd_link(host_of(k), 255 - link_of(k));
+    }
+    return (now() - start) / lookups;
+}
+
+static double time_sockets(int lookups) {
+    double start = now();
+    int i, k;
+    for(i = 0; i < lookups; i++) {
+        k = keys[i % KEYS];
+        sink = conn_find_sockets(host_of(k), sock_of(k), k);
+    }
+    return (now() - start) / lookups;
+}
+
+static double time_scan(int lookups) {
+    double start = now();
+    int i, k;
+    for(i = 0; i < lookups; i++) {
+        k = keys[i % KEYS];
+        sink = scan_link(host_of(k), link_of(k));
+    }
+    return (now() - start) / lookups;
+}
+
+int main(int argc, char **argv) {
+    int i, j, n = 0;
+    unsigned x = 1;
+
+    conn_init();
+
+    printf("%11s %11s %11s %11s %11s\n",
+           "connections", "rcv_link", "snd_link", "sockets", "scan");
+    for(i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        for(; n < sizes[i]; n++) {
+            j = conn_make(host_of(n), sock_of(n), n, sock_of(n) + 1, n + 1);
+            if(j == -1) {
+                fprintf(stderr, "Table full at %d connections.\n", n);
+                return 1;
+            }
+            conn_set_link(j, &connection[j].rcv, link_of(n));
+            conn_set_link(j, &connection[j].snd, 255 - link_of(n));
+        }
+        for(j = 0; j < KEYS; j++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            keys[j] = x % n;
+        }
+        printf("%11d %8.1f ns %8.1f ns %8.1f ns %8.1f ns\n", n,
+               time_rcv_link(LOOKUPS), time_snd_link(LOOKUPS),
+               time_sockets(LOOKUPS), time_scan(LOOKUPS / n + KEYS));
+    }
+    return 0;
+}
@@ -0,0 +1,356 @@
+/* Microbenchmarks for the per-message paths of the NCP daemon: parsing
+     messages from the IMP, building control commands and messages, IMP
+     framing, connection lookups and checking application requests.
+
+     ncp.c is compiled into this file so that its static functions can be
+     called directly.    The IMP interface runs as if replaying an empty
+     capture, so frames are built but never sent.    Memory allocations are
+     counted by wrapping malloc, calloc and realloc at link time, which
+     needs the GNU linker.
+
+     Each result is the best of several runs, in nanoseconds per operation
+     along with allocations per operation.    -o writes the results to a
+     file, one line per benchmark, and -c compares with such a file from
+     an earlier build. */
+
+#include <time.h>
+
+#define main ncp_main
+#include "ncp.c"
+#undef main
+
+#define HOST 1
+#define LINK 42
+#define CONNECTIONS 200 //On hosts 2 and up.
+#define RUNS 5
+#define MIN_TIME 20e6 //Nanoseconds for one run.
+
+static unsigned long allocs;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t n, size_t size);
+extern void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+static volatile int sink;
+static int data_conn;
+static uint8_t message[IMP_BUFFER];
+static int message_words;
+
+static double nanoseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void bench_wire_check(long n) {
+    static const int size[] = { 11, 14, 13, 13, 111, 11, 11 };
+    static const int type[] = { WIRE_ECHO, WIRE_OPEN, WIRE_LISTEN, WIRE_READ,
+                                WIRE_WRITE, WIRE_INTERRUPT, WIRE_CLOSE };
+    long i;
+    for(i = 0; i < n; i++)
+        sink = wire_check(type[i % 7], size[i % 7]);
+}
+
+static void bench_find_rcv_link(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        sink = conn_find_rcv_link(i % CONNECTIONS + 2, LINK);
+}
+
+static void bench_find_snd_link(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        sink = conn_find_snd_link(i % CONNECTIONS + 2, LINK + 1);
+}
+
+static void bench_find_sockets(long n) {
+    long i;
+    int k;
+    for(i = 0; i < n; i++) {
+        k = i % CONNECTIONS;
+        sink = conn_find_sockets(k + 2, 1002 + 2 * k, 2000 + 2 * k);
+    }
+}
+
+static void bench_imp_send_message(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        imp_send_message(packet, 2 + 53);
+}
+
+// A data message of 100 octets on a link without a connection, so it
+// isn't queued.
+static void bench_send_imp(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        send_imp(0, IMP_REGULAR, HOST, LINK_MAX + 1, 0, 0, NULL, 2 + 53);
+}
+
+// A data message of 100 octets through the connection's link queue,
+// followed by its RFNM.
+static void bench_send_imp_rfnm(long n) {
+    uint8_t rfnm[4] = { IMP_RFNM, HOST, LINK + 1, 0 };
+    long i;
+    rfnm_wait = 1;
+    for(i = 0; i < n; i++) {
+        send_imp(0, IMP_REGULAR, HOST, LINK + 1, 0, 0, NULL, 2 + 53);
+        process_imp(rfnm, 2);
+    }
+    rfnm_wait = 0;
+}
+
+static void bench_send_ncp(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        send_ncp(HOST, 1, NCP_NOP);
+}
+
+static void bench_ncp_rts(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        ncp_rts(HOST, 1002, 2000, LINK);
+}
+
+static void bench_ncp_str(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        ncp_str(HOST, 1003, 2001, 8);
+}
+
+static void bench_ncp_all(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        ncp_all(HOST, LINK, 16, 65536);
+}
+
+static void bench_process_rfnm(long n) {
+    uint8_t rfnm[4] = { IMP_RFNM, HOST, LINK_MAX + 1, 0 };
+    long i;
+    for(i = 0; i < n; i++)
+        process_imp(rfnm, 2);
+}
+
+// A data message of 100 octets into the receive ring of a connection.
+static void bench_process_data(long n) {
+    struct connection *c = &connection[data_conn];
+    long i;
+    for(i = 0; i < n; i++) {
+        process_imp(message, message_words);
+        c->in.head = c->in.length = 0;
+        c->rcv.msgs = ALLOC_MSGS;
+        c->rcv.bits = 8 * window;
+    }
+}
+
+// A control message with eight ALL commands.
+static void bench_process_control(long n) {
+    long i;
+    for(i = 0; i < n; i++)
+        process_imp(message, message_words);
+}
+
+static void bench_process_ncp(long n) {
+    uint8_t all[8] = { NCP_ALL, LINK + 1, 0, 1, 0, 0, 0, 8 };
+    long i;
+    for(i = 0; i < n; i++)
+        process_ncp(HOST, all, sizeof all);
+}
+
+// Build the data message to the connection for bench_process_data.
+static void data_message(void) {
+    memset(message, 0, sizeof message);
+    message[0] = IMP_REGULAR;
+    message[1] = HOST;
+    message[2] = LINK;
+    message[5] = 8;
+    message[7] = 100;
+    message_words = 2 + (5 + 100 + 1) / 2;
+}
+
+// Build a control message with eight ALL commands for bench_process_control.
+static void control_message(void) {
+    int i;
+    memset(message, 0, sizeof message);
+    message[0] = IMP_REGULAR;
+    message[1] = HOST;
+    message[2] = LINK_CTL;
+    message[5] = 8;
+    message[7] = 8 * 8;
+    for(i = 0; i < 8; i++) {
+        message[9 + 8 * i] = NCP_ALL;
+        message[10 + 8 * i] = LINK + 1;
+        message[12 + 8 * i] = 1;
+        message[16 + 8 * i] = 8;
+    }
+    message_words = 2 + (5 + 64 + 1) / 2;
+}
+
+static struct bench {
+    const char *name;
+    void (*run)(long n);
+    void (*setup)(void);
+    double ns, allocs;
+} bench[] = {
+    { "wire_check", bench_wire_check },
+    { "conn_find_rcv_link", bench_find_rcv_link },
+    { "conn_find_snd_link", bench_find_snd_link },
+    { "conn_find_sockets", bench_find_sockets },
+    { "imp_send_message", bench_imp_send_message },
+    { "send_imp", bench_send_imp },
+    { "send_imp_queued_rfnm", bench_send_imp_rfnm },
+    { "send_ncp", bench_send_ncp },
+    { "ncp_rts", bench_ncp_rts },
+    { "ncp_str", bench_ncp_str },
+    { "ncp_all", bench_ncp_all },
+    { "process_imp_rfnm", bench_process_rfnm },
+    { "process_imp_data", bench_process_data, data_message },
+    { "process_imp_control", bench_process_control, control_message },
+    { "process_ncp_all", bench_process_ncp },
+};
+
+#define BENCHES (int)(sizeof bench / sizeof bench[0])
+
+static void setup(void) {
+    char path[] = "/tmp/bench_ncp.XXXXXX";
+    int i, f;
+
+    log_option("none");
+    f = mkstemp(path);
+    if(f == -1 || write(f, "H316CAP1", 8) != 8) { //A capture, see imp.c.
+        perror("bench_ncp");
+        exit(1);
+    }
+    close(f);
+    imp_replay(path, 0);
+    unlink(path);
+    rfnm_wait = 0;
+
+    conn_init();
+    for(i = 0; i < CONNECTIONS; i++) {
+        f = conn_make(i + 2, 1002 + 2 * i, 2000 + 2 * i,
+                      1003 + 2 * i, 2001 + 2 * i);
+        conn_set_link(f, &connection[f].rcv, LINK);
+        conn_set_link(f, &connection[f].snd, LINK + 1);
+    }
+    data_conn = conn_make(HOST, 1002, 2000, 1003, 2001);
+    conn_set_link(data_conn, &connection[data_conn].rcv, LINK);
+    conn_set_link(data_conn, &connection[data_conn].snd, LINK + 1);
+    memset(packet, 0, sizeof packet);
+}
+
+static void measure(struct bench *b) {
+    double t, start;
+    unsigned long a;
+    long n = 1;
+    int i;
+
+    if(b->setup != NULL)
+        b->setup();
+    for(;;) {
+        start = nanoseconds();
+        b->run(n);
+        t = nanoseconds() - start;
+        if(t >= MIN_TIME || n >= 1L << 30)
+            break;
+        n *= t < MIN_TIME / 100 ? 10 : 2;
+    }
+    b->ns = t / n;
+    b->allocs = 0;
+    for(i = 1; i < RUNS; i++) {
+        a = allocs;
+        start = nanoseconds();
+        b->run(n);
+        t = nanoseconds() - start;
+        if(t / n < b->ns)
+            b->ns = t / n;
+        b->allocs = (double)(allocs - a) / n;
+    }
+    flush_all_commands();
+}
+
+// Find a result in a file written by -o.
+static int baseline(FILE *f, const char *name, double *ns, double *allocs) {
+    char line[200], other[100];
+
+    rewind(f);
+    while(fgets(line, sizeof line, f) != NULL) {
+        if(line[0] == '#')
+            continue;
+        if(sscanf(line, "%99s %lf %lf", other, ns, allocs) == 3
+           && strcmp(name, other) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void bench_usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-o output] [-c baseline] [benchmark...]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    FILE *output = NULL, *compare = NULL;
+    double ns, a;
+    int i, j, c;
+
+    while((c = getopt(argc, argv, "c:o:")) != -1) {
+        switch(c) {
+        case 'c':
+            compare = fopen(optarg, "r");
+            if(compare == NULL) {
+                perror(optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            output = fopen(optarg, "w");
+            if(output == NULL) {
+                perror(optarg);
+                exit(1);
+            }
+            break;
+        default:
+            bench_usage(argv[0]);
+        }
+    }
+
+    setup();
+    if(output != NULL)
+        fprintf(output, "# benchmark ns/op allocs/op\n");
+    printf("%-24s %10s %10s", "benchmark", "ns/op", "allocs/op");
+    printf(compare != NULL ? " %10s %8s\n" : "\n", "was", "change");
+    for(i = 0; i < BENCHES; i++) {
+        for(j = optind; j < argc; j++) {
+            if(strcmp(argv[j], bench[i].name) == 0)
+                break;
+        }
+        if(optind < argc && j == argc)
+            continue;
+        measure(&bench[i]);
+        printf("%-24s %10.1f %10.2f", bench[i].name, bench[i].ns, bench[i].allocs);
+        if(compare != NULL && baseline(compare, bench[i].name, &ns, &a))
+            printf(" %10.1f %+7.1f%%", ns, 100 * (bench[i].ns - ns) / ns);
+        printf("\n");
+        if(output != NULL)
+            fprintf(output, "%s %.2f %.3f\n", bench[i].name, bench[i].ns,
+                    bench[i].allocs);
+    }
+    if(output != NULL)
+        fclose(output);
+    return 0;
+}
@@ -0,0 +1,429 @@
+/* Connection, listen and echo tables for the NCP daemon.    The tables
+     grow on demand and are indexed by hash chains, so lookups by link,
+     socket or echoed octet take constant time regardless of the number
+     of entries. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "conn.h"
+#include "log.h"
+#include "timer.h"
+
+#define CONNECTIONS 16 //Initial table size, a power of two.
+
+struct connection *connection;
+int connections;
+static int conn_free;
+static int *link_hash, *sock_hash;
+
+struct listen *listening;
+int listens;
+static int listen_free;
+static int *listen_hash;
+
+struct echo *echo;
+int echoes;
+static int echo_free;
+static int *echo_hash;
+static unsigned echo_serial;
+
+static unsigned mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x45d9f3b;
+    x ^= x >> 16;
+    x *= 0x45d9f3b;
+    x ^= x >> 16;
+    return x;
+}
+
+static unsigned hash_link(int host, int link) {
+    return mix(host << 8 | link) & (connections - 1);
+}
+
+static unsigned hash_sock(int host, uint32_t lsock) {
+    return mix(lsock ^ mix(host)) & (connections - 1);
+}
+
+static unsigned hash_listen(uint32_t sock) {
+    return mix(sock) & (listens - 1);
+}
+
+static unsigned hash_echo(int host, int data) {
+    return mix(host << 8 | data) & (echoes - 1);
+}
+
+// Chain nodes are connection halves: 2*i for rcv, 2*i+1 for snd.
+static struct half *half(int n) {
+    return (n & 1) ? &connection[n >> 1].snd : &connection[n >> 1].rcv;
+}
+
+static int node(int i, struct half *h) {
+    return 2 * i + (h == &connection[i].snd);
+}
+
+static void link_insert(int n) {
+    int *head = &link_hash[hash_link(connection[n >> 1].host, half(n)->link)];
+    half(n)->link_next = *head;
+    *head = n;
+}
+
+static void link_remove(int n) {
+    int *p = &link_hash[hash_link(connection[n >> 1].host, half(n)->link)];
+    while(*p != n)
+        p = &half(*p)->link_next;
+    *p = half(n)->link_next;
+}
+
+static void sock_insert(int n) {
+    int *head = &sock_hash[hash_sock(connection[n >> 1].host, half(n)->lsock)];
+    half(n)->sock_next = *head;
+    *head = n;
+}
+
+static void sock_remove(int n) {
+    int *p = &sock_hash[hash_sock(connection[n >> 1].host, half(n)->lsock)];
+    while(*p != n)
+        p = &half(*p)->sock_next;
+    *p = half(n)->sock_next;
+}
+
+static void clear(int i) {
+    connection[i].host = connection[i].rcv.link = connection[i].snd.link =
+        connection[i].snd.size = connection[i].rcv.size = -1;
+    connection[i].rcv.lsock = connection[i].rcv.rsock =
+        connection[i].snd.lsock = connection[i].snd.rsock = 0;
+    connection[i].rcv.msgs = connection[i].snd.msgs = 0;
+    connection[i].rcv.bits = connection[i].snd.bits = 0;
+    memset(&connection[i].queue, 0, sizeof connection[i].queue);
+    memset(&connection[i].in, 0, sizeof connection[i].in);
+    memset(&connection[i].out, 0, sizeof connection[i].out);
+    connection[i].reading = connection[i].writing = connection[i].eof = 0;
+    connection[i].opening = connection[i].closing = 0;
+    connection[i].rcv_eof = connection[i].shut = 0;
+    connection[i].len = 0;
+    connection[i].stream = -1;
+    connection[i].shm = NULL;
+    connection[i].shm_event = connection[i].shm_signal = -1;
+    connection[i].stream_events = connection[i].stream_eof =
+        connection[i].draining = 0;
+    connection[i].timer = connection[i].read_timer =
+        connection[i].write_timer = 0;
+}
+
+static int *make_hash(int n) {
+    int *hash = malloc(n * sizeof *hash);
+    if(hash == NULL) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+        exit(1);
+    }
+    memset(hash, -1, n * sizeof *hash);
+    return hash;
+}
+
+static int grow(void) {
+    struct connection *table;
+    int i, n;
+
+    n = connections == 0 ? CONNECTIONS : 2 * connections;
+    if(connections > CONN_MAX)
+        return -1;
+    table = realloc(connection, n * sizeof *table);
+    if(table == NULL)
+        return -1;
+    connection = table;
+
+    // Push new entries so that the lowest numbers are used first.
+    for(i = n - 1; i >= connections; i--) {
+        clear(i);
+        if(i >= CONN_TIMEOUT)
+            continue;
+        connection[i].free_next = conn_free;
+        conn_free = i;
+    }
+    connections = n;
+
+    free(link_hash);
+    free(sock_hash);
+    link_hash = make_hash(n);
+    sock_hash = make_hash(n);
+    for(i = 0; i < n; i++) {
+        if(connection[i].host == -1)
+            continue;
+        if(connection[i].rcv.link != -1)
+            link_insert(2 * i);
+        if(connection[i].snd.link != -1)
+            link_insert(2 * i + 1);
+        if(connection[i].rcv.lsock != 0)
+            sock_insert(2 * i);
+        if(connection[i].snd.lsock != 0)
+            sock_insert(2 * i + 1);
+    }
+    return 0;
+}
+
+int conn_make(int host,
+              uint32_t rcv_lsock, uint32_t rcv_rsock,
+              uint32_t snd_lsock, uint32_t snd_rsock) {
+    int i;
+
+    if(conn_free == -1 && grow() == -1) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Connection table full.\n");
+        return -1;
+    }
+    i = conn_free;
+    conn_free = connection[i].free_next;
+
+    connection[i].host = host;
+    conn_set_sockets(i, &connection[i].rcv, rcv_lsock, rcv_rsock);
+    conn_set_sockets(i, &connection[i].snd, snd_lsock, snd_rsock);
+    return i;
+}
+
+void conn_destroy(int i) {
+    if(connection[i].host == -1)
+        return;
+    conn_set_link(i, &connection[i].rcv, -1);
+    conn_set_link(i, &connection[i].snd, -1);
+    conn_set_sockets(i, &connection[i].rcv, 0, 0);
+    conn_set_sockets(i, &connection[i].snd, 0, 0);
+    timer_stop(connection[i].timer);
+    timer_stop(connection[i].read_timer);
+    timer_stop(connection[i].write_timer);
+    queue_clear(&connection[i].queue);
+    ring_free(&connection[i].in);
+    buffer_free(&connection[i].out);
+    clear(i);
+    connection[i].free_next = conn_free;
+    conn_free = i;
+}
+
+void conn_set_link(int i, struct half *h, int link) {
+    if(h->link != -1)
+        link_remove(node(i, h));
+    h->link = link;
+    if(link != -1)
+        link_insert(node(i, h));
+}
+
+void conn_set_sockets(int i, struct half *h, uint32_t lsock, uint32_t rsock) {
+    if(h->lsock != 0)
+        sock_remove(node(i, h));
+    h->lsock = lsock;
+    h->rsock = rsock;
+    if(lsock != 0)
+        sock_insert(node(i, h));
+}
+
+static int find_link(int host, int link, int snd) {
+    int n;
+    if(connections == 0)
+        return -1;
+    for(n = link_hash[hash_link(host, link)]; n != -1; n = half(n)->link_next) {
+        if((n & 1) == snd && connection[n >> 1].host == host
+                && half(n)->link == link)
+            return n >> 1;
+    }
+    return -1;
+}
+
+int conn_find_rcv_link(int host, int link) {
+    return find_link(host, link, 0);
+}
+
+int conn_find_snd_link(int host, int link) {
+    return find_link(host, link, 1);
+}
+
+int conn_find_socket(int host, uint32_t lsock) {
+    int n;
+    if(connections == 0)
+        return -1;
+    for(n = sock_hash[hash_sock(host, lsock)]; n != -1; n = half(n)->sock_next) {
+        if(connection[n >> 1].host == host && half(n)->lsock == lsock)
+            return n >> 1;
+    }
+    return -1;
+}
+
+int conn_find_sockets(int host, uint32_t lsock, uint32_t rsock) {
+    int n;
+    if(connections == 0)
+        return -1;
+    for(n = sock_hash[hash_sock(host, lsock)]; n != -1; n = half(n)->sock_next) {
+        if(connection[n >> 1].host == host && half(n)->lsock == lsock
+                && half(n)->rsock == rsock)
+            return n >> 1;
+    }
+    return -1;
+}
+
+static int listen_grow(void) {
+    struct listen *table;
+    int i, n;
+
+    n = listens == 0 ? CONNECTIONS : 2 * listens;
+    table = realloc(listening, n * sizeof *table);
+    if(table == NULL)
+        return -1;
+    listening = table;
+
+    for(i = n - 1; i >= listens; i--) {
+        listening[i].sock = 0;
+        listening[i].timer = 0;
+        listening[i].free_next = listen_free;
+        listen_free = i;
+    }
+    listens = n;
+
+    free(listen_hash);
+    listen_hash = make_hash(n);
+    for(i = 0; i < n; i++) {
+        unsigned h;
+        if(listening[i].sock == 0)
+            continue;
+        h = hash_listen(listening[i].sock);
+        listening[i].next = listen_hash[h];
+        listen_hash[h] = i;
+    }
+    return 0;
+}
+
+int listen_make(uint32_t sock) {
+    unsigned h;
+    int i;
+
+    if(listen_free == -1 && listen_grow() == -1) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Listen table full.\n");
+        return -1;
+    }
+    i = listen_free;
+    listen_free = listening[i].free_next;
+
+    listening[i].sock = sock;
+    h = hash_listen(sock);
+    listening[i].next = listen_hash[h];
+    listen_hash[h] = i;
+    return i;
+}
+
+void listen_destroy(int i) {
+    int *p;
+    if(listening[i].sock == 0)
+        return;
+    p = &listen_hash[hash_listen(listening[i].sock)];
+    while(*p != i)
+        p = &listening[*p].next;
+    *p = listening[i].next;
+    timer_stop(listening[i].timer);
+    listening[i].timer = 0;
+    listening[i].sock = 0;
+    listening[i].free_next = listen_free;
+    listen_free = i;
+}
+
+static int listen_lookup(uint32_t sock) {
+    int i;
+    if(listens == 0)
+        return -1;
+    for(i = listen_hash[hash_listen(sock)]; i != -1; i = listening[i].next) {
+        if(listening[i].sock == sock)
+            return i;
+    }
+    return -1;
+}
+
+// A listen covers both sockets of a pair.
+int listen_find(uint32_t sock) {
+    int i = listen_lookup(sock);
+    if(i == -1 && sock != 0)
+        i = listen_lookup(sock - 1);
+    return i;
+}
+
+static int echo_grow(void) {
+    struct echo *table;
+    int i, n;
+
+    n = echoes == 0 ? CONNECTIONS : 2 * echoes;
+    table = realloc(echo, n * sizeof *table);
+    if(table == NULL)
+        return -1;
+    echo = table;
+
+    for(i = n - 1; i >= echoes; i--) {
+        echo[i].host = -1;
+        echo[i].timer = 0;
+        echo[i].free_next = echo_free;
+        echo_free = i;
+    }
+    echoes = n;
+
+    free(echo_hash);
+    echo_hash = make_hash(n);
+    for(i = 0; i < n; i++) {
+        unsigned h;
+        if(echo[i].host == -1)
+            continue;
+        h = hash_echo(echo[i].host, echo[i].data);
+        echo[i].next = echo_hash[h];
+        echo_hash[h] = i;
+    }
+    return 0;
+}
+
+int echo_make(int host, int data) {
+    unsigned h;
+    int i;
+
+    if(echo_free == -1 && echo_grow() == -1) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Echo table full.\n");
+        return -1;
+    }
+    i = echo_free;
+    echo_free = echo[i].free_next;
+
+    echo[i].host = host;
+    echo[i].data = data;
+    echo[i].serial = echo_serial++;
+    h = hash_echo(host, data);
+    echo[i].next = echo_hash[h];
+    echo_hash[h] = i;
+    return i;
+}
+
+void echo_destroy(int i) {
+    int *p;
+    if(echo[i].host == -1)
+        return;
+    p = &echo_hash[hash_echo(echo[i].host, echo[i].data)];
+    while(*p != i)
+        p = &echo[*p].next;
+    *p = echo[i].next;
+    timer_stop(echo[i].timer);
+    echo[i].timer = 0;
+    echo[i].host = -1;
+    echo[i].free_next = echo_free;
+    echo_free = i;
+}
+
+// ERPs answer ECOs with the same octet in the order they were sent.
+int echo_find(int host, int data) {
+    int i, oldest = -1;
+    if(echoes == 0)
+        return -1;
+    for(i = echo_hash[hash_echo(host, data)]; i != -1; i = echo[i].next) {
+        if(echo[i].host == host && echo[i].data == data
+           && (oldest == -1 || (int)(echo[i].serial - echo[oldest].serial) < 0))
+            oldest = i;
+    }
+    return oldest;
+}
+
+void conn_init(void) {
+    conn_free = listen_free = echo_free = -1;
+    if(grow() == -1 || listen_grow() == -1 || echo_grow() == -1) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+        exit(1);
+    }
+}
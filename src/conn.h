@@ -0,0 +1,96 @@
+/* Connection, listen and echo tables for the NCP daemon. */
+
+#include <stdint.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "queue.h"
+
+#define CONN_MAX 0xFFFF     //Connection number reserved for errors,
+#define CONN_TIMEOUT 0xFFFE //and for requests which timed out.
+
+struct half {
+    int link, size;
+    uint32_t lsock, rsock;
+    int msgs;      //Allocation: granted to us on snd,
+    uint32_t bits; //outstanding from us on rcv.
+    int link_next, sock_next; //Hash chains.
+};
+
+struct shm;
+
+struct connection {
+    struct sockaddr_un client;
+    socklen_t len;
+    int host;
+    struct half rcv, snd;
+    struct queue queue; //Messages on the send link.
+    struct ring in;     //Received, not yet read by the application.
+    struct buffer out;  //Written by the application, not yet sent.
+    int reading;        //Octets requested by a pending read.
+    int writing;        //A write waits for out to drain.
+    int eof;            //Closed by the remote, not yet by the application.
+    int rcv_eof;        //The remote closed only its side, the receive link.
+    int shut;           //We closed only our side, the send link.
+    int opening;        //An open by the application waits for the RFC.
+    int closing;        //CLS on the send link waits for the queue to drain.
+    int timer;          //Pending RFC, or deadline of an open or close.
+    int read_timer, write_timer; //Deadlines of a read and a write.
+    int stream;         //Socket carrying the data to the application, or -1.
+    int stream_events;  //What the event loop watches it for.
+    int stream_eof;     //The application is done writing to it.
+    int draining;       //Close the connection once out is sent.
+    struct shm *shm;    //Rings shared with the application, or NULL.
+    int shm_event;      //Eventfd the application signals us with,
+    int shm_signal;     //and the one we signal it with.
+    uint32_t open_id;   //Id of the open, listen or close to answer,
+    uint32_t read_id;   //of the read
+    uint32_t write_id;  //and of the write.
+    int free_next;
+};
+
+struct listen {
+    struct sockaddr_un client;
+    socklen_t len;
+    uint32_t sock;
+    uint32_t id;
+    int timer;
+    int next, free_next;
+};
+
+// An ECO waiting for its ERP.
+struct echo {
+    struct sockaddr_un client;
+    socklen_t len;
+    int host, data; //Host -1 when free.
+    uint32_t id;
+    unsigned serial;  //Order of sending.
+    int timer;
+    int next, free_next;
+};
+
+extern struct connection *connection;
+extern int connections;
+extern struct listen *listening;
+extern int listens;
+extern struct echo *echo;
+extern int echoes;
+
+extern void conn_init(void);
+extern int conn_make(int host,
+                     uint32_t rcv_lsock, uint32_t rcv_rsock,
+                     uint32_t snd_lsock, uint32_t snd_rsock);
+extern void conn_destroy(int i);
+extern void conn_set_link(int i, struct half *h, int link);
+extern void conn_set_sockets(int i, struct half *h,
+                             uint32_t lsock, uint32_t rsock);
+extern int conn_find_rcv_link(int host, int link);
+extern int conn_find_snd_link(int host, int link);
+extern int conn_find_socket(int host, uint32_t lsock);
+extern int conn_find_sockets(int host, uint32_t lsock, uint32_t rsock);
+extern int listen_make(uint32_t sock);
+extern void listen_destroy(int i);
+extern int listen_find(uint32_t sock);
+extern int echo_make(int host, int data);
+extern void echo_destroy(int i);
+extern int echo_find(int host, int data);
@@ -0,0 +1,181 @@
+/* Event loop for the NCP daemon.    Waits for input on any number of
+     file descriptors and for the next timer, using epoll on Linux and
+     poll elsewhere.    Descriptors are edge triggered: a handler must
+     read until there is nothing left, and all descriptors are set to
+     non-blocking.    A descriptor can be watched for being writable too,
+     or not for being readable while its handler can't take more. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && !defined(USE_POLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "event.h"
+#include "timer.h"
+#include "log.h"
+
+#define EVENTS 64 //Events handled per wakeup.
+
+// Indexed by file descriptor.
+static struct watch {
+    void (*handler)(int arg);
+    int arg;
+    int index; //In pfd.
+} *watch;
+static int watches;
+
+#ifdef USE_EPOLL
+static int epfd;
+#else
+static struct pollfd *pfd;
+static int npfd;
+#endif
+
+static void fatal(const char *message) {
+    LOG(LOG_NCP, LOG_ERROR, "NCP: %s: %s.\n", message, strerror(errno));
+    exit(1);
+}
+
+void event_init(void) {
+#ifdef USE_EPOLL
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd == -1)
+        fatal("epoll_create1");
+#endif
+}
+
+void event_add(int fd, void (*h)(int arg), int arg) {
+    int flags;
+
+    if(fd >= watches) {
+        int n = watches == 0 ? 16 : watches;
+        struct watch *table;
+        while(n <= fd)
+            n *= 2;
+        table = realloc(watch, n * sizeof *table);
+        if(table == NULL)
+            fatal("event_add");
+        memset(table + watches, 0, (n - watches) * sizeof *table);
+        watch = table;
+        watches = n;
+    }
+    watch[fd].handler = h;
+    watch[fd].arg = arg;
+
+    flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        fatal("fcntl");
+
+#ifdef USE_EPOLL
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            fatal("epoll_ctl");
+    }
+#else
+    {
+        int i;
+        // Reuse an entry of a removed descriptor.
+        for(i = 0; i < npfd && pfd[i].fd != -1; i++)
+            ;
+        if(i == npfd) {
+            struct pollfd *table = realloc(pfd, (npfd + 1) * sizeof *table);
+            if(table == NULL)
+                fatal("event_add");
+            pfd = table;
+            npfd++;
+        }
+        pfd[i].fd = fd;
+        pfd[i].events = POLLIN;
+        pfd[i].revents = 0;
+        watch[fd].index = i;
+    }
+#endif
+
+    // Anything that arrived before now won't trigger an edge.
+    h(arg);
+}
+
+// Watching for being readable again triggers an edge if it is.
+void event_watch(int fd, int events) {
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLET;
+    if(events & EVENT_READ)
+        ev.events |= EPOLLIN;
+    if(events & EVENT_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+        fatal("epoll_ctl");
+#else
+    struct pollfd *p = &pfd[watch[fd].index];
+    p->events = 0;
+    if(events & EVENT_READ)
+        p->events |= POLLIN;
+    if(events & EVENT_WRITE)
+        p->events |= POLLOUT;
+#endif
+}
+
+// Call before closing the descriptor.
+void event_remove(int fd) {
+#ifdef USE_EPOLL
+    if(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+        fatal("epoll_ctl");
+#else
+    pfd[watch[fd].index].fd = -1;
+#endif
+    watch[fd].handler = NULL;
+}
+
+// Wait until a descriptor is readable or a timer expires, and call
+// the handlers.    Don't wait longer than limit milliseconds, unless
+// it's -1.
+void event_poll(int limit) {
+    int i, n, timeout = timer_next();
+#ifdef USE_EPOLL
+    struct epoll_event ev[EVENTS];
+#endif
+    if(limit >= 0 && (timeout == -1 || limit < timeout))
+        timeout = limit;
+#ifdef USE_EPOLL
+    n = epoll_wait(epfd, ev, EVENTS, timeout);
+#else
+    n = poll(pfd, npfd, timeout);
+#endif
+    if(n == -1 && errno != EINTR)
+        LOG(LOG_NCP, LOG_ERROR, "NCP: event wait error: %s.\n", strerror(errno));
+
+    timer_run(timer_now());
+
+#ifdef USE_EPOLL
+    for(i = 0; i < n; i++) {
+        struct watch *w = &watch[ev[i].data.fd];
+        if(w->handler != NULL)
+            w->handler(w->arg);
+    }
+#else
+    for(i = 0; i < npfd && n > 0; i++) {
+        struct watch *w;
+        if(pfd[i].fd == -1 || pfd[i].revents == 0)
+            continue;
+        n--;
+        w = &watch[pfd[i].fd];
+        if(w->handler != NULL)
+            w->handler(w->arg);
+    }
+#endif
+}
@@ -0,0 +1,12 @@
+/* Event loop for the NCP daemon. */
+
+#define EVENT_READ  1
+#define EVENT_WRITE 2
+
+extern void event_init(void);
+/* The handler is called with arg when the descriptor may be readable,
+   or writable if event_watch asks for that. */
+extern void event_add(int fd, void (*handler)(int arg), int arg);
+extern void event_watch(int fd, int events);
+extern void event_remove(int fd);
+extern void event_poll(int limit);
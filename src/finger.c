@@ -45,7 +45,7 @@ int main(int argc, char **argv) {
     }
 
     size = sizeof reply;
-    if(ncp_read(connection, reply, &size) == -1) {
+    if(ncp_read(connection, reply, &size) != 0) {
         fprintf(stderr, "NCP read error.\n");
         exit(1);
     }
@@ -8,7 +8,7 @@
 int main(int argc, char **argv) {
     char command[1000];
     char reply[1000];
-    int host, connection, size;
+    int host, connection, size, r;
 
     if(argc != 1) {
         fprintf(stderr, "Usage: %s\n", argv[0]);
@@ -22,13 +22,16 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if(ncp_listen(0117, &host, &connection) == -1) {
+    do
+        r = ncp_listen(0117, &host, &connection);
+    while(r == NCP_TIMEOUT); //Nobody yet.
+    if(r != 0) {
         fprintf(stderr, "NCP listen error.\n");
         exit(1);
     }
 
     size = sizeof command;
-    if(ncp_read(connection, command, &size) == -1) {
+    if(ncp_read(connection, command, &size) != 0) {
         fprintf(stderr, "NCP read error.\n");
         exit(1);
     }
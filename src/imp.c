@@ -1,5 +1,9 @@
-/* Interface between NCP and IMP. */
+/* Interface between NCP and IMP.    Frames are received in batches of
+     up to BATCH per system call, and frames sent during one pass of the
+     event loop go out together when imp_flush is called. */
 
+#define _GNU_SOURCE
+#include <time.h>
 #include <stdio.h>
 #include <errno.h>
 #include <netdb.h>
@@ -11,10 +15,21 @@
 #include <netinet/in.h>
 
 #include "imp.h"
+#include "log.h"
 
 #define FLAG_LAST        0001
 #define FLAG_READY     0002
 
+// A frame this far behind is taken as a duplicate, farther as a resync.
+#define SEQUENCE_WINDOW 1024
+
+#if defined(__linux__) && !defined(NO_MMSG)
+#define USE_MMSG
+#define BATCH 32
+#else
+#define BATCH 1
+#endif
+
 static int imp_sock;
 static int port;
 static struct sockaddr_in destination;
@@ -22,6 +37,59 @@ static uint16_t imp_ready = 0;
 static uint16_t imp_flags = 0;
 static uint32_t rx_sequence, tx_sequence;
 
+static uint8_t rx_frame[BATCH][IMP_BUFFER];
+static int rx_length[BATCH];
+static int rx_count, rx_next; //Frames in the batch, next to process.
+static uint8_t tx_frame[BATCH][IMP_BUFFER];
+static int tx_length[BATCH];
+static int tx_count;
+static unsigned long rx_batches, rx_frames, tx_batches, tx_frames;
+static unsigned long overruns, gaps;
+
+/* A capture file starts with CAPTURE_MAGIC.    Each frame to or from the
+   IMP is then recorded as an 8-octet timestamp in nanoseconds, one octet
+   of direction, a 2-octet length and the frame as it went over UDP.
+   Numbers are most significant octet first. */
+#define CAPTURE_MAGIC "H316CAP1"
+#define CAPTURE_IN  0
+#define CAPTURE_OUT 1
+
+static FILE *capture;
+static FILE *replay;
+static int replay_realtime;
+static uint8_t replay_frame[IMP_BUFFER]; //Next frame from the IMP.
+static int replay_length;                //-1 at the end of the file.
+static uint64_t replay_time, replay_base, replay_start;
+static unsigned long replayed;
+
+/* Fault injection, for testing how the NCP recovers.    Frames from the
+   socket, and frames about to be sent, are dropped, duplicated, reordered,
+   delayed or corrupted with the probabilities given to imp_faults.    A
+   held frame is let through when it's due; a reordered one right behind
+   the next frame in the same direction. */
+#define FAULT_IN  0
+#define FAULT_OUT 1
+#define HOLD 64
+#define REORDER_WAIT 10 //Milliseconds a reordered frame waits for the next.
+
+static int faults;
+static struct {
+    double drop, duplicate, reorder, delay, corrupt;
+} fault_rate[2];
+static int fault_delay = 20; //Longest delay in milliseconds.
+static uint64_t fault_seed = 1;
+static struct {
+    uint64_t due;   //Nanoseconds, monotonic.
+    int after_next;
+    int length;
+    uint8_t data[IMP_BUFFER];
+} held[2][HOLD];
+static int holding[2];
+static uint8_t released[IMP_BUFFER];
+static struct {
+    unsigned long dropped, duplicated, reordered, delayed, corrupted;
+} injected[2];
+
 static const char *type_name[] = {
     "REGULAR",    // 0
     "ER_LEAD",    // 1
@@ -42,7 +110,7 @@ static const char *type_name[] = {
 };
 
 static void fatal(const char *message) {
-    fprintf(stderr, "Fatal error: %s\n", message);
+    LOG(LOG_IMP, LOG_ERROR, "Fatal error: %s\n", message);
     exit(1);
 }
 
@@ -88,8 +156,196 @@ static void make_socket(void) {
         fatal("bind");
 }
 
+static uint64_t nanoseconds(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void capture_frame(int direction, uint8_t *frame, int n) {
+    uint8_t record[11];
+    uint64_t t = nanoseconds(CLOCK_REALTIME);
+    int i;
+
+    for(i = 0; i < 8; i++)
+        record[i] = t >> (56 - 8 * i);
+    record[8] = direction;
+    record[9] = n >> 8;
+    record[10] = n;
+    if(fwrite(record, sizeof record, 1, capture) != 1
+            || fwrite(frame, n, 1, capture) != 1) {
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Capture write error: %s\n", strerror(errno));
+        fclose(capture);
+        capture = NULL;
+    }
+}
+
+// Record all frames to and from the IMP at the end of a file.
+void imp_capture(const char *path) {
+    capture = fopen(path, "ab");
+    if(capture == NULL)
+        fatal("capture file");
+    setvbuf(capture, NULL, _IOFBF, 64 * 1024);
+    if(ftell(capture) == 0)
+        fwrite(CAPTURE_MAGIC, 8, 1, capture);
+}
+
+// Set up fault injection from a list like "drop=1,dup=0.5,delay=2,ms=50".
+// Probabilities are in percent, for both directions unless dir=in or
+// dir=out is given.    Returns -1 if the list is bad.
+int imp_faults(const char *spec) {
+    char *copy = strdup(spec), *word, *value;
+    double rate[5] = { 0, 0, 0, 0, 0 };
+    int i, first = FAULT_IN, last = FAULT_OUT;
+    static const char *name[] = { "drop", "dup", "reorder", "delay", "corrupt" };
+
+    for(word = strtok(copy, ","); word != NULL; word = strtok(NULL, ",")) {
+        value = strchr(word, '=');
+        if(value == NULL)
+            goto bad;
+        *value++ = 0;
+        for(i = 0; i < 5; i++) {
+            if(strcmp(word, name[i]) == 0)
+                break;
+        }
+        if(i < 5) {
+            rate[i] = atof(value) / 100;
+            if(rate[i] < 0 || rate[i] > 1)
+                goto bad;
+        } else if(strcmp(word, "ms") == 0) {
+            fault_delay = atoi(value);
+            if(fault_delay < 1)
+                goto bad;
+        } else if(strcmp(word, "seed") == 0) {
+            fault_seed = strtoull(value, NULL, 0);
+            if(fault_seed == 0)
+                fault_seed = 1;
+        } else if(strcmp(word, "dir") == 0 && strcmp(value, "in") == 0)
+            last = FAULT_IN;
+        else if(strcmp(word, "dir") == 0 && strcmp(value, "out") == 0)
+            first = FAULT_OUT;
+        else
+            goto bad;
+    }
+    free(copy);
+
+    for(i = first; i <= last; i++) {
+        fault_rate[i].drop = rate[0];
+        fault_rate[i].duplicate = rate[1];
+        fault_rate[i].reorder = rate[2];
+        fault_rate[i].delay = rate[3];
+        fault_rate[i].corrupt = rate[4];
+    }
+    faults = 1;
+    return 0;
+
+ bad:
+    free(copy);
+    return -1;
+}
+
+// Uniform in [0, 1), from xorshift64* so a seed gives the same faults.
+static double fault_random(void) {
+    fault_seed ^= fault_seed >> 12;
+    fault_seed ^= fault_seed << 25;
+    fault_seed ^= fault_seed >> 27;
+    return ((fault_seed * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static int hold(int direction, uint8_t *frame, int n, uint64_t due,
+                int after_next) {
+    int i = holding[direction];
+    if(i == HOLD)
+        return 0;
+    held[direction][i].due = due;
+    held[direction][i].after_next = after_next;
+    held[direction][i].length = n;
+    memcpy(held[direction][i].data, frame, n);
+    holding[direction]++;
+    return 1;
+}
+
+// Copy out the held frame which is most overdue.    Returns 0 if none is due.
+static int release(int direction, uint8_t *frame, int *n) {
+    uint64_t now = nanoseconds(CLOCK_MONOTONIC);
+    int i, j = -1;
+
+    for(i = 0; i < holding[direction]; i++) {
+        if(held[direction][i].due <= now
+           && (j == -1 || held[direction][i].due < held[direction][j].due))
+            j = i;
+    }
+    if(j == -1)
+        return 0;
+    *n = held[direction][j].length;
+    memcpy(frame, held[direction][j].data, *n);
+    held[direction][j] = held[direction][--holding[direction]];
+    return 1;
+}
+
+// Returns 1 if the frame should go through now, perhaps damaged, or 0 if
+// it's been dropped or held.
+static int fault(int direction, uint8_t *frame, int *n) {
+    uint64_t now = nanoseconds(CLOCK_MONOTONIC);
+    int i;
+
+    if(fault_random() < fault_rate[direction].drop) {
+        injected[direction].dropped++;
+        return 0;
+    }
+    if(*n > 0 && fault_random() < fault_rate[direction].corrupt) {
+        frame[(int)(fault_random() * *n)] ^= 1 << (int)(fault_random() * 8);
+        injected[direction].corrupted++;
+    }
+    if(fault_random() < fault_rate[direction].delay
+       && hold(direction, frame, *n, now + (1 + (uint64_t)(fault_random()
+                                  * fault_delay)) * 1000000, 0)) {
+        injected[direction].delayed++;
+        return 0;
+    }
+    if(fault_random() < fault_rate[direction].reorder
+       && hold(direction, frame, *n, now + REORDER_WAIT * 1000000, 1)) {
+        injected[direction].reordered++;
+        return 0;
+    }
+    for(i = 0; i < holding[direction]; i++) {
+        if(held[direction][i].after_next) {
+            held[direction][i].after_next = 0;
+            held[direction][i].due = now;
+        }
+    }
+    if(fault_random() < fault_rate[direction].duplicate
+       && hold(direction, frame, *n, now, 0))
+        injected[direction].duplicated++;
+    return 1;
+}
+
+// Pass the frames to send through fault injection, and add the held
+// ones which are due.
+static void fault_flush(void) {
+    int i, n = 0;
+    for(i = 0; i < tx_count; i++) {
+        if(!fault(FAULT_OUT, tx_frame[i], &tx_length[i]))
+            continue;
+        if(n != i) {
+            memcpy(tx_frame[n], tx_frame[i], tx_length[i]);
+            tx_length[n] = tx_length[i];
+        }
+        n++;
+    }
+    tx_count = n;
+    while(tx_count < BATCH
+          && release(FAULT_OUT, tx_frame[tx_count], &tx_length[tx_count]))
+        tx_count++;
+}
+
+// Queue a message to the IMP.    It's sent by imp_flush, or right away
+// if the batch is full.
 void imp_send_message(uint8_t *data, int length) {
-    int r;
+    if(tx_count == BATCH)
+        imp_flush();
+    memcpy(tx_frame[tx_count] + 12, data + 12, 2 * length);
+    data = tx_frame[tx_count];
 
     data[0] = 'H';
     data[1] = '3';
@@ -103,40 +359,290 @@ void imp_send_message(uint8_t *data, int length) {
     data[9] = length;
     data[10] = imp_flags >> 8;
     data[11] = imp_flags | FLAG_LAST;
+    tx_length[tx_count++] = 2 * length + 10;
+    if(capture != NULL)
+        capture_frame(CAPTURE_OUT, data, 2 * length + 10);
 
-    r = sendto(imp_sock, data, 2 * length + 10, 0,
-                         (struct sockaddr *)&destination, sizeof destination);
-    if(r == -1)
-        fprintf(stderr, "IMP: Send error: %s\n", strerror(errno));
     if(length == 1)
-        fprintf(stderr, "IMP: Send #%u: host ready bit.\n", tx_sequence);
+        LOG(LOG_IMP, LOG_DEBUG, "IMP: Send #%u: host ready bit.\n", tx_sequence);
     else
-        fprintf(stderr, "IMP: Send #%u: type %d/%s, destination %03o, %d words.\n",
+        LOG(LOG_IMP, LOG_DEBUG, "IMP: Send #%u: type %d/%s, destination %03o, %d words.\n",
                          tx_sequence, data[12] & 0x0F, type_name[data[12] & 0x0F],
                          data[13], length - 1);
     tx_sequence++;
 }
 
+void imp_flush(void) {
+    int i = 0, r;
+
+    if(capture != NULL)
+        fflush(capture);
+    if(faults)
+        fault_flush();
+    if(tx_count == 0)
+        return;
+    tx_batches++;
+    tx_frames += tx_count;
+    if(replay != NULL) {
+        tx_count = 0; //Nobody to send to.
+        return;
+    }
+
+#ifdef USE_MMSG
+    {
+        struct mmsghdr msg[BATCH];
+        struct iovec iov[BATCH];
+        memset(msg, 0, tx_count * sizeof msg[0]);
+        for(i = 0; i < tx_count; i++) {
+            iov[i].iov_base = tx_frame[i];
+            iov[i].iov_len = tx_length[i];
+            msg[i].msg_hdr.msg_name = &destination;
+            msg[i].msg_hdr.msg_namelen = sizeof destination;
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        for(i = 0; i < tx_count; ) {
+            r = sendmmsg(imp_sock, msg + i, tx_count - i, 0);
+            if(r > 0) {
+                i += r;
+                continue;
+            }
+            if(r == -1 && errno == EINTR)
+                continue;
+            LOG(LOG_IMP, LOG_ERROR, "IMP: Send error: %s\n", strerror(errno));
+            i++; //Drop the frame which failed.
+        }
+    }
+#else
+    for(i = 0; i < tx_count; i++) {
+        r = sendto(imp_sock, tx_frame[i], tx_length[i], 0,
+                   (struct sockaddr *)&destination, sizeof destination);
+        if(r == -1)
+            LOG(LOG_IMP, LOG_ERROR, "IMP: Send error: %s\n", strerror(errno));
+    }
+#endif
+    tx_count = 0;
+}
+
+// Read ahead to the next frame from the IMP in the replay file.
+static void next_record(void) {
+    uint8_t record[11];
+    int i;
+
+    for(;;) {
+        if(fread(record, sizeof record, 1, replay) != 1)
+            break;
+        replay_length = record[9] << 8 | record[10];
+        if(replay_length > IMP_BUFFER)
+            break;
+        if(fread(replay_frame, replay_length, 1, replay) != 1)
+            break;
+        if(record[8] != CAPTURE_IN)
+            continue;
+        replay_time = 0;
+        for(i = 0; i < 8; i++)
+            replay_time = replay_time << 8 | record[i];
+        if(replay_base == 0)
+            replay_base = replay_time;
+        return;
+    }
+
+    if(!feof(replay))
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Replay file is damaged.\n");
+    replay_length = -1;
+}
+
+// Take frames from a capture file instead of the IMP.    They come as
+// fast as they are processed, or with their recorded timing.
+void imp_replay(const char *path, int realtime) {
+    char magic[8];
+
+    replay = fopen(path, "rb");
+    if(replay == NULL)
+        fatal("replay file");
+    if(fread(magic, sizeof magic, 1, replay) != 1
+            || memcmp(magic, CAPTURE_MAGIC, sizeof magic) != 0)
+        fatal("not a capture file");
+    replay_realtime = realtime;
+    replay_start = nanoseconds(CLOCK_MONOTONIC);
+    imp_sock = -1;
+    next_record();
+}
+
+// Milliseconds until the next replayed frame is due, or -1 if there
+// are no more.
+int imp_replay_next(void) {
+    uint64_t due, now;
+
+    if(replay == NULL)
+        return -1;
+    if(rx_next < rx_count)
+        return 0;
+    if(replay_length == -1) {
+        if(replay_start != 0) {
+            double seconds = (nanoseconds(CLOCK_MONOTONIC) - replay_start) / 1e9;
+            LOG(LOG_IMP, LOG_INFO,
+                "IMP: Replayed %lu frames in %.3f s, %.0f per second.\n",
+                replayed, seconds, seconds > 0 ? replayed / seconds : 0);
+            replay_start = 0;
+        }
+        return -1;
+    }
+    if(!replay_realtime)
+        return 0;
+    due = replay_start + (replay_time - replay_base);
+    now = nanoseconds(CLOCK_MONOTONIC);
+    return now >= due ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+// Milliseconds until a replayed or held frame is due, or -1 if there
+// is none.
+int imp_next(void) {
+    int t = imp_replay_next(), ms, d, i;
+    uint64_t now;
+
+    if(!faults)
+        return t;
+    now = nanoseconds(CLOCK_MONOTONIC);
+    for(d = FAULT_IN; d <= FAULT_OUT; d++) {
+        for(i = 0; i < holding[d]; i++) {
+            if(held[d][i].due <= now)
+                return 0;
+            ms = (held[d][i].due - now + 999999) / 1000000;
+            if(t == -1 || ms < t)
+                t = ms;
+        }
+    }
+    return t;
+}
+
+// Fill the receive batch.    Returns 0 when there is nothing to read.
+static int receive_batch(void) {
+    int n;
+
+    rx_count = rx_next = 0;
+    if(replay != NULL) {
+        for(n = 0; n < BATCH && imp_replay_next() == 0; n++) {
+            memcpy(rx_frame[n], replay_frame, replay_length);
+            rx_length[n] = replay_length;
+            replayed++;
+            next_record();
+        }
+        if(n == 0)
+            return 0;
+        rx_count = n;
+        rx_batches++;
+        rx_frames += n;
+        return 1;
+    }
+#ifdef USE_MMSG
+    {
+        struct mmsghdr msg[BATCH];
+        struct iovec iov[BATCH];
+        int i;
+        memset(msg, 0, sizeof msg);
+        for(i = 0; i < BATCH; i++) {
+            iov[i].iov_base = rx_frame[i];
+            iov[i].iov_len = IMP_BUFFER;
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(imp_sock, msg, BATCH, MSG_DONTWAIT, NULL);
+        for(i = 0; i < n; i++)
+            rx_length[i] = msg[i].msg_len;
+    }
+#else
+    n = read(imp_sock, rx_frame[0], IMP_BUFFER);
+    if(n >= 0) {
+        rx_length[0] = n;
+        n = 1;
+    }
+#endif
+    if(n == -1) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Receive error: %s\n", strerror(errno));
+        return errno == EINTR ? receive_batch() : 1;
+    }
+    rx_count = n;
+    rx_batches++;
+    rx_frames += n;
+    return 1;
+}
+
+void imp_statistics(void) {
+    int i;
+
+    if(rx_batches > 0)
+        LOG(LOG_IMP, LOG_INFO, "IMP: Received %lu frames in %lu batches, %.2f per batch.\n",
+                         rx_frames, rx_batches, (double)rx_frames / rx_batches);
+    if(tx_batches > 0)
+        LOG(LOG_IMP, LOG_INFO, "IMP: Sent %lu frames in %lu batches, %.2f per batch.\n",
+                         tx_frames, tx_batches, (double)tx_frames / tx_batches);
+    if(overruns > 0 || gaps > 0)
+        LOG(LOG_IMP, LOG_INFO, "IMP: %lu overruns, %lu sequence gaps.\n",
+                         overruns, gaps);
+    for(i = FAULT_IN; faults && i <= FAULT_OUT; i++)
+        LOG(LOG_IMP, LOG_INFO, "IMP: Injected %s: %lu dropped, %lu duplicated, "
+            "%lu reordered, %lu delayed, %lu corrupted.\n",
+            i == FAULT_IN ? "receiving" : "sending", injected[i].dropped,
+            injected[i].duplicated, injected[i].reordered,
+            injected[i].delayed, injected[i].corrupted);
+    rx_batches = rx_frames = tx_batches = tx_frames = 0;
+    overruns = gaps = 0;
+    memset(injected, 0, sizeof injected);
+}
+
 static void ready_nop(int flag) {
 }
 
 void(*imp_imp_ready)(int flag) = ready_nop;
 
-static uint8_t message[200];
+/* A message may come in several frames.    It's assembled here across
+   calls, so the event loop keeps running while waiting for the rest.
+   A message which overruns the buffer, or which has a frame missing,
+   is discarded up to its last frame. */
+static enum { IDLE, ASSEMBLING, DISCARDING } state = IDLE;
+static uint8_t assembly[IMP_BUFFER];
+static int assembled, words;
 
-void imp_receive_message(uint8_t *data, int *length) {
+static void discard(const char *reason) {
+    if(state == IDLE)
+        return;
+    LOG(LOG_IMP, LOG_INFO, "IMP: Discarding partial message: %s.\n", reason);
+    state = DISCARDING;
+    assembled = words = 0;
+}
+
+// Read one frame from the IMP.    Returns 0 when there is nothing more
+// to read.    A complete message is stored in data and its length in
+// words in *length; otherwise *length is 0.
+int imp_receive_message(uint8_t *data, int *length) {
+    uint8_t *message;
     uint32_t x;
     int n;
 
     *length = 0;
 
- loop:
-    n = read(imp_sock, message, sizeof message);
-    if(n == 0)
-        return;
-    else if(n == -1) {
-        fprintf(stderr, "IMP: Receive error: %s\n", strerror(errno));
-        return;
+    if(faults && release(FAULT_IN, released, &n))
+        message = released;
+    else {
+        if(rx_next == rx_count && !receive_batch())
+            return 0;
+        if(rx_count == 0)
+            return 1;
+        message = rx_frame[rx_next];
+        n = rx_length[rx_next++];
+        // The capture has the frames as they came, before any faults.
+        if(capture != NULL)
+            capture_frame(CAPTURE_IN, message, n);
+        if(faults && !fault(FAULT_IN, message, &n))
+            return 1;
+    }
+    if(n < 12) {
+        if(n > 0)
+            LOG(LOG_IMP, LOG_ERROR, "IMP: Receive error: short frame.\n");
+        return 1;
     }
 
     if(message[0] != 'H' ||
@@ -144,65 +650,95 @@ void imp_receive_message(uint8_t *data, int *length) {
             message[2] != '1' ||
             message[3] != '6') {
         int i;
-        fprintf(stderr, "IMP: Receive error: bad magic.\n");
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Receive error: bad magic.\n");
         for(i = 0; i < n; i++)
-            fprintf(stderr, "%02X ", message[i]);
-        return;
+            LOG(LOG_IMP, LOG_ERROR, "%02X%s", message[i], i == n - 1 ? "\n" : " ");
+        return 1;
     }
 
     x =(message[4] << 24) |(message[5] << 16) |(message[6] << 8) | message[7];
     if(x == 0 && rx_sequence != 0) {
-        fprintf(stderr, "IMP: Sequence number restarted.\n");
+        LOG(LOG_IMP, LOG_INFO, "IMP: Sequence number restarted.\n");
+        discard("sequence restarted");
         rx_sequence = x;
+    } else if(x < rx_sequence && rx_sequence - x <= SEQUENCE_WINDOW) {
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Bad sequence number: %u.\n", x);
+        return 1;
     } else if(x < rx_sequence) {
-        fprintf(stderr, "IMP: Bad sequence number: %u.\n", x);
-        *length = 0;
-        return;
+        // Far behind; the last number must have been damaged.
+        LOG(LOG_IMP, LOG_INFO, "IMP: Sequence number %u out of step, "
+            "expected %u.\n", x, rx_sequence);
+        discard("sequence out of step");
+        rx_sequence = x;
     } else if(x != rx_sequence) {
+        LOG(LOG_IMP, LOG_INFO, "IMP: Sequence gap, %u frames missing.\n",
+                         x - rx_sequence);
+        gaps++;
+        discard("frame missing");
         rx_sequence = x;
     }
     rx_sequence++;
 
     x = message[8] << 8 | message[9];
-    *length += x - 1;
-    if(n != 2 * x + 10)
-        fprintf(stderr, "IMP: Receive bad length.\n");
+    if(n != 2 * x + 10) {
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Receive bad length.\n");
+        discard("bad length");
+        if(message[11] & FLAG_LAST)
+            state = IDLE;
+        return 1;
+    }
+    if(state == DISCARDING) {
+        if(message[11] & FLAG_LAST)
+            state = IDLE;
+        return 1;
+    }
+    if(assembled + n - 12 > sizeof assembly) {
+        LOG(LOG_IMP, LOG_ERROR, "IMP: Receive overrun, discarding message.\n");
+        overruns++;
+        assembled = words = 0;
+        state = (message[11] & FLAG_LAST) ? IDLE : DISCARDING;
+        return 1;
+    }
+    words += x - 1;
 
-    if(*length == 0)
-        return;
+    if(words == 0)
+        return 1;
 
     x =(message[10] << 8) | message[11];
     if((x & FLAG_READY) ^ imp_ready) {
         imp_ready = x & FLAG_READY;
         if(imp_ready)
-            fprintf(stderr, "IMP: Ready.\n");
+            LOG(LOG_IMP, LOG_INFO, "IMP: Ready.\n");
         else
-            fprintf(stderr, "IMP: Not ready.\n");
+            LOG(LOG_IMP, LOG_INFO, "IMP: Not ready.\n");
         imp_imp_ready(imp_ready);
     }
 
-    memcpy(data, message + 12, n - 12);
-    data += n - 12;
-
-    fprintf(stderr, "IMP: Flags are %04X.\n", x);
-    if((x & FLAG_LAST) == 0)
-        goto loop;
+    memcpy(assembly + assembled, message + 12, n - 12);
+    assembled += n - 12;
 
-    fprintf(stderr, "IMP: Receive #%u: type %d/%s, source %03o, %d words.\n",
-                     rx_sequence - 1, message[12] & 0x0F, type_name[message[12] & 0x0F],
-                     message[13], *length);
-    if((message[12] & 0x0F) != 0)
-        fprintf(stderr, "IMP: flags %02o, link %03o, id %02o, subtype %02o.\n",
-                         message[12] >> 4, message[14], message[15] >> 4,
-                         message[15] & 0x0F);
-}
+    LOG(LOG_IMP, LOG_DEBUG, "IMP: Flags are %04X.\n", x);
+    if((x & FLAG_LAST) == 0) {
+        state = ASSEMBLING;
+        return 1;
+    }
 
-void imp_fd_set(fd_set *fdset) {
-    FD_SET(imp_sock, fdset);
+    memcpy(data, assembly, assembled);
+    *length = words;
+    assembled = words = 0;
+    state = IDLE;
+    LOG(LOG_IMP, LOG_DEBUG, "IMP: Receive #%u: type %d/%s, source %03o, %d words.\n",
+                     rx_sequence - 1, data[0] & 0x0F, type_name[data[0] & 0x0F],
+                     data[1], *length);
+    if((data[0] & 0x0F) != 0)
+        LOG(LOG_IMP, LOG_DEBUG, "IMP: flags %02o, link %03o, id %02o, subtype %02o.\n",
+                         data[0] >> 4, data[2], data[3] >> 4,
+                         data[3] & 0x0F);
+    return 1;
 }
 
-int imp_fd_isset(fd_set *fdset) {
-    return FD_ISSET(imp_sock, fdset);
+int imp_fd(void) {
+    return imp_sock;
 }
 
 void imp_init(int argc, char **argv) {
@@ -1,7 +1,22 @@
+/* Largest message to or from the IMP: 32 bits of leader and up to 8063
+   bits of data, rounded up to 16-bit words. */
+#define IMP_MAX_BITS 8063
+#define IMP_MAX_WORDS (2 + (IMP_MAX_BITS + 15) / 16)
+
+/* Buffers passed to imp_send_message and imp_receive_message have room
+   for the 12-octet frame header in front of the message. */
+#define IMP_BUFFER (12 + 2 * IMP_MAX_WORDS)
+
 extern void imp_init(int argc, char **argv);
 extern void imp_send_message(uint8_t *data, int length);
-extern void imp_receive_message(uint8_t *data, int *length);
-extern void imp_fd_set(fd_set *fdset);
-extern int imp_fd_isset(fd_set *fdset);
+extern void imp_flush(void);
+extern void imp_statistics(void);
+extern int imp_receive_message(uint8_t *data, int *length);
+extern int imp_fd(void);
+extern void imp_capture(const char *path);
+extern void imp_replay(const char *path, int realtime);
+extern int imp_replay_next(void);
+extern int imp_next(void);
+extern int imp_faults(const char *spec);
 extern void imp_host_ready(int flag);
 extern void (*imp_imp_ready)(int flag);
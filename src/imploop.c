@@ -0,0 +1,759 @@
+/* Loopback IMP.    Stands in for a network of IMPs so that NCP daemons
+     can talk to each other without SIMH.    Each attached host has a UDP
+     port where its NCP finds its IMP, using the same framing as imp.c.
+     A regular message is passed on to the destination host and answered
+     with a RFNM; if the destination isn't attached or its NCP isn't ready,
+     the answer is HOST DEAD.    Frames are read and written in batches.
+
+     Given a topology file, it emulates a subnet instead: hosts sit on the
+     IMP given by the low six bits of their number, and messages travel
+     from IMP to IMP over trunks with delay, jitter, limited bandwidth,
+     loss, duplication and reordering.    RFNMs travel back the same way.
+     A message lost on a trunk is reported to the sender as INCOMPLETE
+     TRANSMISSION. */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "imp.h"
+
+#define FLAG_LAST        0001
+#define FLAG_READY       0002
+
+#define IMP_REGULAR         0
+#define IMP_NOP             4
+#define IMP_RFNM            5
+#define IMP_DEAD            7
+#define IMP_INCOMPLETE      9
+
+#define DEAD_UNREACHABLE    0 //Subtypes of HOST DEAD.
+#define DEAD_NOT_UP         1
+#define INCOMPLETE_LOST     3 //Subtype of INCOMPLETE TRANSMISSION.
+
+#define IMPS               64
+#define OVERHEAD           64 //Bits a trunk spends on each message besides the text.
+
+#if defined(__linux__) && !defined(NO_MMSG)
+#define USE_MMSG
+#define BATCH 64
+#else
+#define BATCH 1
+#endif
+
+struct host {
+    int number;
+    int sock;
+    struct sockaddr_in ncp;
+    uint32_t sequence;
+    int ready;
+    uint8_t frame[BATCH][IMP_BUFFER]; //Waiting to be sent to the NCP.
+    int length[BATCH];
+    int count;
+};
+
+static struct host *host[256];
+static struct pollfd *pfd;
+static struct host **attached; //In the same order as pfd.
+static int hosts;
+static int verbose;
+static volatile sig_atomic_t quit;
+
+static unsigned long messages, rfnms, deads, incompletes;
+static unsigned long frames_in, frames_out, receives, sends;
+
+// One direction of a trunk between two IMPs.    Times in microseconds.
+struct line {
+    int from, to;
+    double delay, jitter, rate; //Rate in bits per second, 0 for no limit.
+    double loss, duplicate, reorder; //Probabilities.
+    uint64_t busy;              //Until the last message is sent.
+    uint64_t last;              //Arrival of the last message kept in order.
+    unsigned long sent, lost, duplicated, reordered;
+};
+
+// A message in the subnet, on its way to an IMP.
+struct packet {
+    uint64_t time, order;       //Arrival, and a tie breaker to keep FIFO.
+    int imp, type;
+    int source, destination;    //Hosts.
+    int duplicate;              //Delivered without a RFNM.
+    int words;
+    struct packet *next;        //Free list.
+    uint8_t data[2 * IMP_MAX_WORDS];
+};
+
+static int subnet;
+static struct line *line, defaults;
+static int lines;
+static int trunk[IMPS][IMPS]; //Index into line, -1 if no trunk.
+static int route[IMPS][IMPS]; //Next IMP on the way, -1 if unreachable.
+static struct packet **heap, *packet_free;
+static int heap_size, heap_max;
+static uint64_t order;
+static uint64_t seed = 1;
+
+static void fatal(const char *message) {
+    fprintf(stderr, "IMPLOOP: %s: %s\n", message, strerror(errno));
+    exit(1);
+}
+
+static void flush(struct host *h) {
+    int i, r;
+
+    if(h->count == 0)
+        return;
+#ifdef USE_MMSG
+    {
+        struct mmsghdr msg[BATCH];
+        struct iovec iov[BATCH];
+        memset(msg, 0, h->count * sizeof msg[0]);
+        for(i = 0; i < h->count; i++) {
+            iov[i].iov_base = h->frame[i];
+            iov[i].iov_len = h->length[i];
+            msg[i].msg_hdr.msg_name = &h->ncp;
+            msg[i].msg_hdr.msg_namelen = sizeof h->ncp;
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        for(i = 0; i < h->count; ) {
+            r = sendmmsg(h->sock, msg + i, h->count - i, 0);
+            sends++;
+            if(r > 0)
+                i += r;
+            else if(errno != EINTR)
+                i++; //Lost, like on a real network.
+        }
+    }
+#else
+    for(i = 0; i < h->count; ) {
+        r = sendto(h->sock, h->frame[i], h->length[i], 0,
+                   (struct sockaddr *)&h->ncp, sizeof h->ncp);
+        sends++;
+        if(r >= 0 || errno != EINTR)
+            i++; //Lost if it failed, like on a real network.
+    }
+#endif
+    frames_out += h->count;
+    h->count = 0;
+}
+
+// Queue a message of words 16-bit words to a host.
+static void send_message(struct host *h, const uint8_t *data, int words) {
+    uint8_t *frame;
+
+    if(h->count == BATCH)
+        flush(h);
+    frame = h->frame[h->count];
+    frame[0] = 'H';
+    frame[1] = '3';
+    frame[2] = '1';
+    frame[3] = '6';
+    frame[4] = h->sequence >> 24;
+    frame[5] = h->sequence >> 16;
+    frame[6] = h->sequence >> 8;
+    frame[7] = h->sequence;
+    frame[8] = (words + 1) >> 8;
+    frame[9] = words + 1;
+    frame[10] = 0;
+    frame[11] = FLAG_READY | FLAG_LAST;
+    memcpy(frame + 12, data, 2 * words);
+    h->length[h->count++] = 12 + 2 * words;
+    h->sequence++;
+}
+
+static void send_leader(struct host *h, int type, int destination,
+                        int link, int subtype) {
+    uint8_t leader[4];
+    leader[0] = type;
+    leader[1] = destination;
+    leader[2] = link;
+    leader[3] = subtype;
+    send_message(h, leader, 2);
+}
+
+static uint64_t now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Uniform in [0, 1), from xorshift64* so a seed gives the same run.
+static double random_fraction(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return ((seed * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static int earlier(struct packet *a, struct packet *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void push(struct packet *p) {
+    int i, parent;
+
+    if(heap_size == heap_max) {
+        heap_max = heap_max == 0 ? 256 : 2 * heap_max;
+        heap = realloc(heap, heap_max * sizeof *heap);
+        if(heap == NULL)
+            fatal("realloc");
+    }
+    p->order = order++;
+    for(i = heap_size++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if(!earlier(p, heap[parent]))
+            break;
+        heap[i] = heap[parent];
+    }
+    heap[i] = p;
+}
+
+static struct packet *pop(void) {
+    struct packet *p = heap[0], *last = heap[--heap_size];
+    int i = 0, child;
+
+    for(;;) {
+        child = 2 * i + 1;
+        if(child >= heap_size)
+            break;
+        if(child + 1 < heap_size && earlier(heap[child + 1], heap[child]))
+            child++;
+        if(!earlier(heap[child], last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return p;
+}
+
+static struct packet *new_packet(void) {
+    struct packet *p = packet_free;
+    if(p != NULL)
+        packet_free = p->next;
+    else if((p = malloc(sizeof *p)) == NULL)
+        fatal("malloc");
+    return p;
+}
+
+static void free_packet(struct packet *p) {
+    p->next = packet_free;
+    packet_free = p;
+}
+
+// Turn a message around into a control message to its source.
+static void back(struct packet *p, int type, int subtype, uint64_t time) {
+    p->type = type;
+    p->data[3] = subtype;
+    p->words = 2;
+    p->duplicate = 0;
+    p->time = time;
+    push(p);
+}
+
+static void transmit(struct line *l, struct packet *p, uint64_t time) {
+    uint64_t arrival;
+
+    l->sent++;
+    if(l->busy > time)
+        time = l->busy;
+    if(l->rate > 0)
+        time += (16.0 * p->words + OVERHEAD) * 1e6 / l->rate;
+    l->busy = time;
+    arrival = time + l->delay + l->jitter * random_fraction();
+    if(l->reorder > 0 && random_fraction() < l->reorder) {
+        // Held back long enough that later messages overtake it.
+        arrival += l->delay + l->jitter + 1000;
+        l->reordered++;
+    } else {
+        if(arrival < l->last)
+            arrival = l->last;
+        l->last = arrival;
+    }
+    p->imp = l->to;
+    p->time = arrival;
+    push(p);
+}
+
+// Send a message one hop closer to the IMP of the target host.
+static void forward(struct packet *p, int target, uint64_t time) {
+    struct line *l;
+    struct packet *copy;
+    int next = route[p->imp][target];
+
+    if(next == -1) {
+        if(p->type == IMP_REGULAR && !p->duplicate) {
+            deads++;
+            back(p, IMP_DEAD, DEAD_UNREACHABLE, time);
+        } else
+            free_packet(p);
+        return;
+    }
+    l = &line[trunk[p->imp][next]];
+    if(p->type == IMP_REGULAR) {
+        if(l->loss > 0 && random_fraction() < l->loss) {
+            l->lost++;
+            if(p->duplicate)
+                free_packet(p);
+            else {
+                incompletes++;
+                back(p, IMP_INCOMPLETE, INCOMPLETE_LOST, time);
+            }
+            return;
+        }
+        if(l->duplicate > 0 && random_fraction() < l->duplicate) {
+            l->duplicated++;
+            copy = new_packet();
+            *copy = *p;
+            copy->duplicate = 1;
+            transmit(l, copy, time);
+        }
+    }
+    transmit(l, p, time);
+}
+
+// A message has reached an IMP.
+static void arrive(struct packet *p, uint64_t time) {
+    struct host *h;
+    int target = p->type == IMP_REGULAR ? p->destination : p->source;
+
+    if(p->imp != (target & (IMPS - 1))) {
+        forward(p, target & (IMPS - 1), time);
+        return;
+    }
+    if(p->type != IMP_REGULAR) {
+        if(host[p->source] != NULL)
+            send_leader(host[p->source], p->type, p->destination,
+                        p->data[2], p->data[3]);
+        free_packet(p);
+        return;
+    }
+
+    h = host[p->destination];
+    if(h == NULL || !h->ready) {
+        if(verbose)
+            fprintf(stderr, "IMPLOOP: %03o -> %03o link %u: host dead.\n",
+                    p->source, p->destination, p->data[2]);
+        if(p->duplicate)
+            free_packet(p);
+        else {
+            deads++;
+            back(p, IMP_DEAD, DEAD_NOT_UP, time);
+        }
+        return;
+    }
+    if(verbose)
+        fprintf(stderr, "IMPLOOP: %03o -> %03o link %u, %d words%s.\n",
+                p->source, p->destination, p->data[2], p->words,
+                p->duplicate ? ", duplicate" : "");
+    p->data[1] = p->source;
+    send_message(h, p->data, p->words);
+    messages++;
+    if(p->duplicate)
+        free_packet(p);
+    else {
+        rfnms++;
+        back(p, IMP_RFNM, p->data[3] & 0x0F, time);
+    }
+}
+
+// Deliver everything due by now.
+static void run(uint64_t time) {
+    while(heap_size > 0 && heap[0]->time <= time)
+        arrive(pop(), time);
+}
+
+// Milliseconds until the next arrival, or -1 if nothing is on its way.
+static int next_arrival(void) {
+    uint64_t time;
+    if(heap_size == 0)
+        return -1;
+    time = now();
+    if(heap[0]->time <= time)
+        return 0;
+    return (heap[0]->time - time + 999) / 1000;
+}
+
+static void enter(struct host *source, uint8_t *data, int words) {
+    struct packet *p = new_packet();
+    p->type = IMP_REGULAR;
+    p->source = source->number;
+    p->destination = data[1];
+    p->duplicate = 0;
+    p->words = words;
+    memcpy(p->data, data, 2 * words);
+    p->imp = source->number & (IMPS - 1);
+    p->time = now();
+    push(p);
+}
+
+static void regular(struct host *source, uint8_t *data, int words) {
+    struct host *destination = host[data[1]];
+    int link = data[2];
+
+    if(subnet) {
+        enter(source, data, words);
+        return;
+    }
+    if(destination == NULL || !destination->ready) {
+        if(verbose)
+            fprintf(stderr, "IMPLOOP: %03o -> %03o link %u: host dead.\n",
+                    source->number, data[1], link);
+        send_leader(source, IMP_DEAD, data[1], link, DEAD_NOT_UP);
+        deads++;
+        return;
+    }
+    if(verbose)
+        fprintf(stderr, "IMPLOOP: %03o -> %03o link %u, %d words.\n",
+                source->number, destination->number, link, words);
+    data[1] = source->number;
+    send_message(destination, data, words);
+    send_leader(source, IMP_RFNM, destination->number, link, data[3] & 0x0F);
+    messages++;
+    rfnms++;
+}
+
+static void frame(struct host *h, uint8_t *frame, int n) {
+    int words, flags;
+
+    frames_in++;
+    if(n < 12 || memcmp(frame, "H316", 4) != 0) {
+        fprintf(stderr, "IMPLOOP: Bad frame from host %03o.\n", h->number);
+        return;
+    }
+    words = (frame[8] << 8 | frame[9]) - 1;
+    flags = frame[10] << 8 | frame[11];
+    if(words < 0 || 12 + 2 * words > n) {
+        fprintf(stderr, "IMPLOOP: Bad length from host %03o.\n", h->number);
+        return;
+    }
+
+    if((flags & FLAG_READY) && !h->ready) {
+        fprintf(stderr, "IMPLOOP: Host %03o up.\n", h->number);
+        h->ready = 1;
+        send_leader(h, IMP_NOP, 0, 0, 0);
+    } else if(!(flags & FLAG_READY) && h->ready) {
+        fprintf(stderr, "IMPLOOP: Host %03o down.\n", h->number);
+        h->ready = 0;
+    }
+
+    if(words < 2)
+        return;
+    if(!(flags & FLAG_LAST)) {
+        fprintf(stderr, "IMPLOOP: Host %03o sent a partial message.\n", h->number);
+        return;
+    }
+    if((frame[12] & 0x0F) == IMP_REGULAR)
+        regular(h, frame + 12, words);
+}
+
+static void receive(struct host *h) {
+    uint8_t buffer[BATCH][IMP_BUFFER];
+    int n;
+
+    for(;;) {
+#ifdef USE_MMSG
+        struct mmsghdr msg[BATCH];
+        struct iovec iov[BATCH];
+        int i;
+        memset(msg, 0, sizeof msg);
+        for(i = 0; i < BATCH; i++) {
+            iov[i].iov_base = buffer[i];
+            iov[i].iov_len = IMP_BUFFER;
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(h->sock, msg, BATCH, MSG_DONTWAIT, NULL);
+        receives++;
+        for(i = 0; i < n; i++)
+            frame(h, buffer[i], msg[i].msg_len);
+#else
+        n = recv(h->sock, buffer[0], IMP_BUFFER, MSG_DONTWAIT);
+        receives++;
+        if(n >= 0) {
+            frame(h, buffer[0], n);
+            n = 1;
+        }
+#endif
+        if(n == -1 && errno != EINTR)
+            return;
+    }
+}
+
+static void attach(int number, int port, const char *address, int ncp_port) {
+    struct sockaddr_in local;
+    struct hostent *e;
+    struct host *h;
+    int size = 1 << 20;
+
+    if(number < 0 || number > 255 || host[number] != NULL) {
+        fprintf(stderr, "IMPLOOP: Bad host number %d.\n", number);
+        exit(1);
+    }
+
+    h = calloc(1, sizeof *h);
+    if(h == NULL)
+        fatal("calloc");
+    h->number = number;
+    h->ncp.sin_family = AF_INET;
+    h->ncp.sin_port = htons(ncp_port);
+    e = gethostbyname(address);
+    if(e == NULL)
+        fatal("gethostbyname");
+    memcpy(&h->ncp.sin_addr, e->h_addr, e->h_length);
+
+    h->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(h->sock == -1)
+        fatal("socket");
+    setsockopt(h->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    setsockopt(h->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    memset(&local, 0, sizeof local);
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = INADDR_ANY;
+    local.sin_port = htons(port);
+    if(bind(h->sock, (struct sockaddr *)&local, sizeof local) == -1)
+        fatal("bind");
+
+    pfd = realloc(pfd, (hosts + 1) * sizeof *pfd);
+    attached = realloc(attached, (hosts + 1) * sizeof *attached);
+    if(pfd == NULL || attached == NULL)
+        fatal("realloc");
+    pfd[hosts].fd = h->sock;
+    pfd[hosts].events = POLLIN;
+    attached[hosts++] = h;
+    host[number] = h;
+}
+
+// Attach a host given as number:port:ncp-port, or number:port:address:ncp-port.
+static void attach_spec(char *spec) {
+    char *field[4], *p;
+    int n = 0;
+
+    for(p = strtok(spec, ":"); p != NULL && n < 4; p = strtok(NULL, ":"))
+        field[n++] = p;
+    if(n < 3 || p != NULL) {
+        fprintf(stderr, "IMPLOOP: Bad host %s.\n", spec);
+        exit(1);
+    }
+    attach(strtol(field[0], NULL, 0), atoi(field[1]),
+           n == 4 ? field[2] : "localhost", atoi(field[n - 1]));
+}
+
+// Set a trunk parameter from name=value.
+static int trunk_option(struct line *l, char *option) {
+    char *value = strchr(option, '=');
+    double x;
+
+    if(value == NULL)
+        return -1;
+    *value++ = 0;
+    x = atof(value);
+    if(x < 0)
+        return -1;
+    if(strcmp(option, "delay") == 0)
+        l->delay = 1000 * x;
+    else if(strcmp(option, "jitter") == 0)
+        l->jitter = 1000 * x;
+    else if(strcmp(option, "rate") == 0)
+        l->rate = x;
+    else if(strcmp(option, "loss") == 0)
+        l->loss = x / 100;
+    else if(strcmp(option, "dup") == 0)
+        l->duplicate = x / 100;
+    else if(strcmp(option, "reorder") == 0)
+        l->reorder = x / 100;
+    else
+        return -1;
+    return 0;
+}
+
+static void add_trunk(int a, int b, struct line *l) {
+    line = realloc(line, (lines + 2) * sizeof *line);
+    if(line == NULL)
+        fatal("realloc");
+    l->from = a;
+    l->to = b;
+    trunk[a][b] = lines;
+    line[lines++] = *l;
+    l->from = b;
+    l->to = a;
+    trunk[b][a] = lines;
+    line[lines++] = *l;
+}
+
+// Least delay routes between all IMPs, counting a microsecond per hop
+// so that equal delays go the shortest way.
+static void compute_routes(void) {
+    static double cost[IMPS][IMPS];
+    int i, j, k;
+
+    for(i = 0; i < IMPS; i++) {
+        for(j = 0; j < IMPS; j++) {
+            cost[i][j] = i == j ? 0 : -1;
+            route[i][j] = i == j ? i : -1;
+            if(trunk[i][j] != -1) {
+                cost[i][j] = line[trunk[i][j]].delay + 1;
+                route[i][j] = j;
+            }
+        }
+    }
+    for(k = 0; k < IMPS; k++) {
+        for(i = 0; i < IMPS; i++) {
+            if(cost[i][k] < 0)
+                continue;
+            for(j = 0; j < IMPS; j++) {
+                if(cost[k][j] < 0)
+                    continue;
+                if(cost[i][j] < 0 || cost[i][k] + cost[k][j] < cost[i][j]) {
+                    cost[i][j] = cost[i][k] + cost[k][j];
+                    route[i][j] = route[i][k];
+                }
+            }
+        }
+    }
+}
+
+// Read a topology file.    Each line is one of
+//     host number port ncp-port [address]
+//     trunk imp imp [option=value]...
+//     default [option=value]...
+// where the options are delay and jitter in milliseconds, rate in bits
+// per second, and loss, dup and reorder in percent.    Defaults apply
+// to the trunks after them.
+static void load(const char *path) {
+    FILE *f = fopen(path, "r");
+    char buffer[1000], *word[32], *p;
+    struct line l;
+    int i, n, a, b, number = 0;
+
+    if(f == NULL)
+        fatal(path);
+    memset(trunk, -1, sizeof trunk);
+    while(fgets(buffer, sizeof buffer, f) != NULL) {
+        number++;
+        if((p = strchr(buffer, '#')) != NULL)
+            *p = 0;
+        n = 0;
+        for(p = strtok(buffer, " \t\r\n"); p != NULL && n < 32;
+            p = strtok(NULL, " \t\r\n"))
+            word[n++] = p;
+        if(n == 0)
+            continue;
+
+        if(strcmp(word[0], "host") == 0 && (n == 4 || n == 5)) {
+            attach(strtol(word[1], NULL, 0), atoi(word[2]),
+                   n == 5 ? word[4] : "localhost", atoi(word[3]));
+            continue;
+        }
+        if(strcmp(word[0], "default") == 0) {
+            for(i = 1; i < n; i++) {
+                if(trunk_option(&defaults, word[i]) == -1)
+                    goto bad;
+            }
+            continue;
+        }
+        if(strcmp(word[0], "trunk") != 0 || n < 3)
+            goto bad;
+        a = strtol(word[1], NULL, 0);
+        b = strtol(word[2], NULL, 0);
+        if(a <= 0 || a >= IMPS || b <= 0 || b >= IMPS || a == b
+           || trunk[a][b] != -1)
+            goto bad;
+        l = defaults;
+        for(i = 3; i < n; i++) {
+            if(trunk_option(&l, word[i]) == -1)
+                goto bad;
+        }
+        add_trunk(a, b, &l);
+    }
+    fclose(f);
+    compute_routes();
+    subnet = 1;
+    return;
+
+ bad:
+    fprintf(stderr, "IMPLOOP: %s line %d is bad.\n", path, number);
+    exit(1);
+}
+
+static void terminate(int sig) {
+    quit = 1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-v] [-s seed] [-t topology] "
+            "[host:port:[address:]ncp-port...]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint64_t start;
+    int i, c;
+
+    while((c = getopt(argc, argv, "s:t:v")) != -1) {
+        switch(c) {
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            if(seed == 0)
+                seed = 1;
+            break;
+        case 't':
+            load(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for(i = optind; i < argc; i++)
+        attach_spec(argv[i]);
+    if(hosts == 0)
+        usage(argv[0]);
+
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+    start = now();
+    while(!quit) {
+        if(poll(pfd, hosts, next_arrival()) == -1) {
+            if(errno == EINTR)
+                continue;
+            fatal("poll");
+        }
+        for(i = 0; i < hosts; i++) {
+            if(pfd[i].revents & POLLIN)
+                receive(attached[i]);
+        }
+        if(subnet)
+            run(now());
+        for(i = 0; i < hosts; i++)
+            flush(attached[i]);
+    }
+
+    fprintf(stderr, "IMPLOOP: %lu messages, %lu RFNMs, %lu host dead, "
+            "%lu incomplete in %.3f s.\n", messages, rfnms, deads,
+            incompletes, (now() - start) / 1e6);
+    fprintf(stderr, "IMPLOOP: %lu frames in, %lu out, %lu receive and %lu "
+            "send calls.\n", frames_in, frames_out, receives, sends);
+    for(i = 0; i < lines; i++) {
+        fprintf(stderr, "IMPLOOP: Trunk %02o -> %02o: %lu sent, %lu lost, "
+                "%lu duplicated, %lu reordered.\n", line[i].from, line[i].to,
+                line[i].sent, line[i].lost, line[i].duplicated,
+                line[i].reordered);
+    }
+    return 0;
+}
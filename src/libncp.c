@@ -1,6 +1,9 @@
 /* Library for applications. */
 
+#include <poll.h>
+#include <time.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -12,11 +15,51 @@
 #include <sys/socket.h>
 
 #include "ncp.h"
+#include "shm.h"
 #include "wire.h"
 
+#define ECHO_WAIT 15000 //Milliseconds; the NCP gives up on an ERP sooner.
+#define GRACE 1000      //Milliseconds for the NCP to answer after a timeout.
+#define TIMEOUT 60000   //Milliseconds a request may take unless told otherwise.
+#define SLOTS 0x10000   //Most requests outstanding; see struct slot.
+#define PASS_MAX 3      //Descriptors passed with one reply.
+#define BATCH_WRITE 256 //Least of a write worth starting in a batch.
+#define REQUEST_SIZE (1 + WIRE_ID_SIZE + WIRE_TIMEOUT_SIZE + 5) //Largest but writes.
+
 static int fd;
+static unsigned timeout = TIMEOUT; //0 waits for ever.
 static struct sockaddr_un addr;
-static uint8_t message[1000];
+static uint8_t message[WIRE_SIZE]; //Request being sent.
+static uint8_t reply[WIRE_SIZE];   //Reply being taken.
+static int size;
+
+/* An outstanding request.    Its id has the index of the slot in the low
+   16 bits and counts the uses of the slot in the rest, so a late reply
+   to a request which was given up on isn't taken for another. */
+struct slot {
+    struct ncp_op *op; //NULL when free.
+    uint32_t id;
+    int offset;        //Octets of a write sent so far.
+    void (*done)(struct ncp_op *op); //NULL to hand the op to ncp_reap.
+    int free_next;
+};
+
+static struct slot *slot;
+static int slots, slot_free = -1;
+
+// Finished requests for ncp_reap, oldest first.
+static struct ncp_op *finished, **finished_tail = &finished;
+
+// Rings shared with the NCP for the data of a connection.
+struct map {
+    struct shm *shm;
+    int fd;      //Eventfd the NCP signals us with,
+    int signal;  //and the one we signal it with.
+    int waiting; //Bit for each ring we asked to be told about.
+};
+
+static struct map **map; //Indexed by connection.
+static int maps;
 
 static void cleanup(void) {
     close(fd);
@@ -29,10 +72,14 @@ static void quit(int x) {
 
 int ncp_init(const char *path) {
     struct sockaddr_un server;
+    int n;
 
     fd = socket(AF_UNIX, SOCK_DGRAM, 0);
     if(fd == -1)
         return -1;
+    // Some systems limit datagrams to the size of the send buffer.
+    n = 2 * WIRE_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &n, sizeof n);
     memset(&addr, 0, sizeof addr);
     addr.sun_family = AF_UNIX;
     snprintf(addr.sun_path, sizeof addr.sun_path - 1,
@@ -56,130 +103,731 @@ int ncp_init(const char *path) {
     return 0;
 }
 
-static int size;
+void ncp_timeout(int ms) {
+    timeout = ms == 0 ? TIMEOUT : ms < 0 ? 0 : ms;
+}
 
-static void type(uint8_t x) {
-    message[0] = x;
-    size = 1;
+// Milliseconds the request may take, 0 for ever.
+static unsigned limit(struct ncp_op *op) {
+    if(op->timeout == 0)
+        return timeout;
+    return op->timeout < 0 ? 0 : op->timeout;
+}
+
+int ncp_fd(void) {
+    return fd;
+}
+
+static uint64_t now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Milliseconds until end, for poll.
+static int remaining(uint64_t end) {
+    uint64_t t = now();
+    return t >= end ? 0 : end - t;
+}
+
+static int slot_make(void) {
+    struct slot *table;
+    int i, n;
+
+    if(slot_free == -1) {
+        n = slots == 0 ? 16 : 2 * slots;
+        if(n > SLOTS)
+            return -1;
+        table = realloc(slot, n * sizeof *table);
+        if(table == NULL)
+            return -1;
+        slot = table;
+        for(i = n - 1; i >= slots; i--) {
+            slot[i].op = NULL;
+            slot[i].id = i;
+            slot[i].free_next = slot_free;
+            slot_free = i;
+        }
+        slots = n;
+    }
+    i = slot_free;
+    slot_free = slot[i].free_next;
+    slot[i].id += SLOTS;
+    return i;
+}
+
+static void slot_destroy(int i) {
+    slot[i].op = NULL;
+    slot[i].free_next = slot_free;
+    slot_free = i;
+}
+
+// Give up on a request; a reply coming later is ignored.
+static void forget(struct ncp_op *op) {
+    int i;
+    for(i = 0; i < slots; i++) {
+        if(slot[i].op == op)
+            slot_destroy(i);
+    }
 }
 
 static void add(uint8_t x) {
     message[size++] = x;
 }
 
-static int transact(void) {
-    int type = message[0];
-    ssize_t n;
-    if(!wire_check(type, size))
+static void add32(uint32_t x) {
+    add(x >> 24);
+    add(x >> 16);
+    add(x >> 8);
+    add(x);
+}
+
+static void type(uint8_t x, uint32_t id, unsigned ms) {
+    add(x);
+    add32(id);
+    add32(ms);
+}
+
+static void add16(uint16_t x) {
+    add(x >> 8);
+    add(x);
+}
+
+static void add_connection(int connection) {
+    add16(connection);
+}
+
+static const uint8_t wire_type[] = {
+    0, WIRE_ECHO, WIRE_OPEN, WIRE_LISTEN, WIRE_READ,
+    WIRE_WRITE, WIRE_INTERRUPT, WIRE_CLOSE, WIRE_STREAM, WIRE_MAP
+};
+
+// Put a request, or the next piece of a large write, at the end of the
+// message, with at most room octets of the write.
+static void build(int i, int room) {
+    struct ncp_op *op = slot[i].op;
+    int n;
+
+    type(wire_type[op->type], slot[i].id, limit(op));
+    switch(op->type) {
+    case NCP_OP_ECHO:
+        add(op->host);
+        add(op->data);
+        break;
+    case NCP_OP_OPEN:
+        add(op->host);
+        add32(op->socket);
+        break;
+    case NCP_OP_LISTEN:
+        add32(op->socket);
+        break;
+    case NCP_OP_READ:
+        add_connection(op->connection);
+        add16(op->length < 0 ? 0 :
+              op->length > WIRE_DATA ? WIRE_DATA : op->length);
+        break;
+    case NCP_OP_WRITE:
+        add_connection(op->connection);
+        n = op->length - slot[i].offset;
+        if(n > room)
+            n = room;
+        if(n > 0) {
+            memcpy(message + size, (uint8_t *)op->buffer + slot[i].offset, n);
+            size += n;
+            slot[i].offset += n;
+        }
+        break;
+    case NCP_OP_INTERRUPT:
+    case NCP_OP_CLOSE:
+    case NCP_OP_STREAM:
+    case NCP_OP_MAP:
+        add_connection(op->connection);
+        break;
+    }
+}
+
+// Send a request, or the next piece of a large write; writes go to the
+// NCP in pieces of WIRE_DATA octets.
+static int send_request(int i) {
+    size = 0;
+    build(i, WIRE_DATA);
+    if(!wire_check(message[0], size))
         return -1;
     if(send(fd, message, size, 0) != size)
         return -1;
-    n = recv(fd, message, sizeof message, 0);
-    if(message[0] != type + 1)
-        return -1;
-    if(!wire_check(message[0], n))
+    return 0;
+}
+
+static int echo_result(int error) {
+    if(error == 0x10)
+        return 0;
+    if(error == WIRE_ECHO_TIMEOUT)
+        return NCP_TIMEOUT;
+    if(error == WIRE_ECHO_FAILED)
         return -1;
-    return n;
+    return -error - 2;
 }
 
-int ncp_echo(int host, int data, int *reply) {
-    type(WIRE_ECHO);
-    add(host);
-    add(data);
-    if(transact() == -1)
+// Map the memory passed by the NCP and keep the eventfds, which are
+// passed after it.
+static int map_add(int connection, int *passed) {
+    struct map **table, *m;
+    int n;
+
+    if(connection >= maps) {
+        n = connection + 1 > 2 * maps ? connection + 1 : 2 * maps;
+        table = realloc(map, n * sizeof *table);
+        if(table == NULL)
+            return -1;
+        memset(table + maps, 0, (n - maps) * sizeof *table);
+        map = table;
+        maps = n;
+    }
+    if(map[connection] != NULL || (m = malloc(sizeof *m)) == NULL)
         return -1;
-    if(message[1] != host)
+    m->shm = shm_map(passed[0]);
+    if(m->shm == NULL) {
+        free(m);
         return -1;
-    *reply = message[2];
-    if(message[3] == 0x10)
+    }
+    close(passed[0]);
+    m->fd = passed[1];
+    m->signal = passed[2];
+    m->waiting = 0;
+    map[connection] = m;
+    return 0;
+}
+
+static struct map *map_find(int connection) {
+    if(connection < 0 || connection >= maps)
+        return NULL;
+    return map[connection];
+}
+
+static void map_destroy(int connection) {
+    struct map *m = map_find(connection);
+    if(m == NULL)
+        return;
+    shm_unmap(m->shm);
+    close(m->fd);
+    close(m->signal);
+    free(m);
+    map[connection] = NULL;
+}
+
+static uint32_t u32(uint8_t *data) {
+    return((uint32_t)data[0] << 24) |(data[1] << 16) |(data[2] << 8) | data[3];
+}
+
+static int u16(uint8_t *data) {
+    return(data[0] << 8) | data[1];
+}
+
+// The result of a request from the n octets of results in its reply,
+// and the descriptors passed with it.
+static int result(struct ncp_op *op, uint8_t *data, int n,
+                  int *passed, int passes) {
+    switch(op->type) {
+    case NCP_OP_ECHO:
+        if(data[0] != (op->host & 0xFF))
+            return -1;
+        op->data = data[1];
+        return echo_result(data[2]);
+    case NCP_OP_OPEN:
+        if(data[0] != (op->host & 0xFF) || u32(data + 1) != op->socket)
+            return -1;
+        if(u16(data + 5) == 0xFFFE)
+            return NCP_TIMEOUT;
+        if(u16(data + 5) == 0xFFFF)
+            return -2;
+        op->connection = u16(data + 5);
+        return 0;
+    case NCP_OP_LISTEN:
+        if(u16(data + 5) == 0xFFFE)
+            return NCP_TIMEOUT;
+        if(data[0] == 0 || u32(data + 1) != op->socket)
+            return -1;
+        op->host = data[0];
+        op->connection = u16(data + 5);
         return 0;
+    default:
+        if(u16(data) == 0xFFFE)
+            return NCP_TIMEOUT;
+        if(u16(data) != op->connection)
+            return -1;
+        if(op->type == NCP_OP_READ) {
+            n -= 2;
+            if(n > op->length)
+                n = op->length;
+            memcpy(op->buffer, data + 2, n);
+            op->length = n;
+        }
+        if(op->type == NCP_OP_STREAM) {
+            if(passes != 1)
+                return -1;
+            op->fd = passed[0];
+        }
+        if(op->type == NCP_OP_MAP) {
+            if(passes != 3 || map_add(op->connection, passed) == -1)
+                return -1;
+            op->fd = passed[1];
+        }
+        return 0;
+    }
+}
+
+static void finish(int i, int result) {
+    struct ncp_op *op = slot[i].op;
+    void (*done)(struct ncp_op *op) = slot[i].done;
+    op->result = result;
+    slot_destroy(i);
+    if(op->type == NCP_OP_CLOSE)
+        map_destroy(op->connection);
+    if(done != NULL) {
+        done(op);
+        return;
+    }
+    op->next = NULL;
+    *finished_tail = op;
+    finished_tail = &op->next;
+}
+
+// Finish the request a reply is for, or send the next piece of a write.
+static void take(uint8_t *reply, int n, int *passed, int passes) {
+    struct ncp_op *op = NULL;
+    uint32_t id;
+    int i, k, r;
+
+    if(n >= 1 + WIRE_ID_SIZE && wire_check(reply[0], n)) {
+        id = u32(reply + 1);
+        i = id % SLOTS;
+        if(i < slots && slot[i].op != NULL && slot[i].id == id)
+            op = slot[i].op;
+    }
+    if(op == NULL || reply[0] != wire_type[op->type] + 1)
+        r = -1;
     else
-        return -message[3] - 2;
+        r = result(op, reply + 1 + WIRE_ID_SIZE, n - 1 - WIRE_ID_SIZE,
+                   passed, passes);
+    for(k = 0; r != 0 && k < passes; k++)
+        close(passed[k]);
+    if(op == NULL)
+        return;
+    if(r == 0 && op->type == NCP_OP_WRITE && slot[i].offset < op->length) {
+        if(send_request(i) == 0)
+            return;
+        r = -1;
+    }
+    finish(i, r);
 }
 
-static int u32(uint8_t *data) {
-    return(data[0] << 24) |(data[1] << 16) |(data[2] << 8) | data[3];
+// Take a reply, or a batch of them, if there is one.
+static int receive(void) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(PASS_MAX * sizeof(int))];
+    } control;
+    int passed[PASS_MAX], passes = 0;
+    struct cmsghdr *c;
+    struct msghdr m;
+    struct iovec v;
+    int i, k;
+    ssize_t n;
+
+    v.iov_base = reply;
+    v.iov_len = sizeof reply;
+    memset(&m, 0, sizeof m);
+    m.msg_iov = &v;
+    m.msg_iovlen = 1;
+    m.msg_control = control.data;
+    m.msg_controllen = sizeof control.data;
+    n = recvmsg(fd, &m, MSG_DONTWAIT);
+    if(n == -1)
+        return 0;
+    c = CMSG_FIRSTHDR(&m);
+    if(c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+        passes = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(passed, CMSG_DATA(c), passes * sizeof(int));
+    }
+
+    if(n < 1 || reply[0] != WIRE_BATCH+1) {
+        take(reply, n, passed, passes);
+        return 1;
+    }
+    for(i = 1 + WIRE_ID_SIZE; n - i >= 2; i += k) {
+        k = reply[i] << 8 | reply[i + 1];
+        i += 2;
+        if(k > n - i)
+            break;
+        take(reply + i, k, NULL, 0);
+    }
+    for(k = 0; k < passes; k++)
+        close(passed[k]);
+    return 1;
 }
 
-int ncp_open(int host, unsigned socket, int *connection) {
-    type(WIRE_OPEN);
-    add(host);
-    add(socket >> 24);
-    add(socket >> 16);
-    add(socket >> 8);
-    add(socket);
-    if(transact() == -1)
+// Wait until there may be a reply, at most ms milliseconds or for ever
+// if -1.
+static int wait_reply(int ms) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    return poll(&p, 1, ms) == 0 ? NCP_TIMEOUT : 0;
+}
+
+static int submit(struct ncp_op *op, void (*done)(struct ncp_op *op)) {
+    int i;
+    if(op->type < NCP_OP_ECHO || op->type > NCP_OP_MAP)
         return -1;
-    if(message[1] != host)
+    i = slot_make();
+    if(i == -1)
         return -1;
-    if(u32(message + 2) != socket)
+    slot[i].op = op;
+    slot[i].offset = 0;
+    slot[i].done = done;
+    if(send_request(i) == -1) {
+        slot_destroy(i);
         return -1;
-    if(message[6] == 255)
-        return -2;
-    *connection = message[6];
+    }
+    // Replies are taken as they come, so they don't pile up unread.
+    while(receive())
+        ;
     return 0;
 }
 
-int ncp_listen(unsigned socket, int *host, int *connection) {
-    type(WIRE_LISTEN);
-    add(socket >> 24);
-    add(socket >> 16);
-    add(socket >> 8);
-    add(socket);
-    if(transact() == -1)
+int ncp_submit(struct ncp_op *op) {
+    return submit(op, NULL);
+}
+
+// Send the batch in the message, holding op[first] up to op[last].
+static int send_batch(struct ncp_op **op, int first, int last) {
+    int k;
+    if(first == last)
+        return 0;
+    if(send(fd, message, size, 0) == size)
+        return 0;
+    for(k = first; k < last; k++)
+        forget(op[k]);
+    return -1;
+}
+
+static int submit_batch(struct ncp_op **op, int n,
+                        void (*done)(struct ncp_op *op)) {
+    int i, k, at, need, first = 0;
+
+    size = 0;
+    type(WIRE_BATCH, 0, 0);
+    for(k = 0; k < n; k++) {
+        if(op[k]->type < NCP_OP_ECHO || op[k]->type > NCP_OP_CLOSE)
+            break;
+        need = 2 + REQUEST_SIZE;
+        if(op[k]->type == NCP_OP_WRITE)
+            need += op[k]->length < BATCH_WRITE ? op[k]->length : BATCH_WRITE;
+        if(size + need > WIRE_SIZE) {
+            if(send_batch(op, first, k) == -1)
+                return first;
+            first = k;
+            size = 0;
+            type(WIRE_BATCH, 0, 0);
+        }
+        i = slot_make();
+        if(i == -1)
+            break;
+        slot[i].op = op[k];
+        slot[i].offset = 0;
+        slot[i].done = done;
+        at = size;
+        size += 2;
+        build(i, WIRE_SIZE - size - (REQUEST_SIZE - 3));
+        message[at] = (size - at - 2) >> 8;
+        message[at + 1] = size - at - 2;
+    }
+    if(send_batch(op, first, k) == -1)
+        return first;
+    while(receive())
+        ;
+    return k;
+}
+
+int ncp_submit_batch(struct ncp_op **op, int n) {
+    return submit_batch(op, n, NULL);
+}
+
+int ncp_reap(struct ncp_op **op, int n, int ms) {
+    uint64_t end = now() + ms;
+    int k;
+
+    while(receive())
+        ;
+    while(finished == NULL && ms != 0) {
+        if(wait_reply(ms < 0 ? -1 : remaining(end)) != 0)
+            break;
+        while(receive())
+            ;
+    }
+    for(k = 0; k < n && finished != NULL; k++) {
+        op[k] = finished;
+        finished = finished->next;
+    }
+    if(finished == NULL)
+        finished_tail = &finished;
+    return k;
+}
+
+static struct ncp_op *waiting;
+
+static void wake(struct ncp_op *op) {
+    if(op == waiting)
+        waiting = NULL;
+}
+
+// Do one request and wait for it, a little longer than the NCP should
+// take.    Replies to other requests are kept for ncp_reap.
+static int run(struct ncp_op *op) {
+    unsigned ms = limit(op);
+    uint64_t end = now() + ms + GRACE;
+
+    waiting = op;
+    if(submit(op, wake) == -1) {
+        waiting = NULL;
         return -1;
-    if(message[1] == 0)
+    }
+    while(waiting != NULL) {
+        if(wait_reply(ms == 0 ? -1 : remaining(end)) != 0) {
+            forget(op);
+            waiting = NULL;
+            return NCP_TIMEOUT;
+        }
+        while(receive())
+            ;
+    }
+    return op->result;
+}
+
+int ncp_echo(int host, int data, int *reply) {
+    struct ncp_op op;
+    int result;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_ECHO;
+    op.host = host;
+    op.data = data;
+    result = run(&op);
+    if(result == 0)
+        *reply = op.data;
+    return result;
+}
+
+static struct ncp_op *many;
+static int many_left;
+static void (*many_done)(int i, int result);
+
+static void echo_done(struct ncp_op *op) {
+    many_left--;
+    many_done(op - many, op->result);
+}
+
+int ncp_echo_many(int n, const int *host, const int *data,
+                  void (*done)(int i, int result)) {
+    struct ncp_op **op;
+    uint64_t end;
+    int i;
+
+    many = calloc(n + 1, sizeof *many);
+    op = calloc(n + 1, sizeof *op);
+    if(many == NULL || op == NULL) {
+        free(many);
+        free(op);
         return -1;
-    if(u32(message + 2) != socket)
+    }
+    many_done = done;
+    many_left = n;
+    for(i = 0; i < n; i++) {
+        many[i].type = NCP_OP_ECHO;
+        many[i].host = host[i];
+        many[i].data = data[i];
+        many[i].result = 1; //Still waiting.
+        op[i] = &many[i];
+    }
+    i = submit_batch(op, n, echo_done);
+    free(op);
+    if(i < n) {
+        for(i = 0; i < n; i++)
+            forget(&many[i]);
+        free(many);
         return -1;
-    *host = message[1];
-    *connection = message[6];
+    }
+    end = now() + (timeout == 0 ? ECHO_WAIT : timeout) + GRACE;
+    while(many_left > 0) {
+        if(wait_reply(remaining(end)) != 0)
+            break;
+        while(receive())
+            ;
+    }
+    for(i = 0; i < n; i++) {
+        if(many[i].result == 1) {
+            forget(&many[i]);
+            done(i, NCP_TIMEOUT);
+        }
+    }
+    free(many);
     return 0;
 }
 
+int ncp_open(int host, unsigned socket, int *connection) {
+    struct ncp_op op;
+    int result;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_OPEN;
+    op.host = host;
+    op.socket = socket;
+    result = run(&op);
+    if(result == 0)
+        *connection = op.connection;
+    return result;
+}
+
+int ncp_listen(unsigned socket, int *host, int *connection) {
+    struct ncp_op op;
+    int result;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_LISTEN;
+    op.socket = socket;
+    result = run(&op);
+    if(result == 0) {
+        *host = op.host;
+        *connection = op.connection;
+    }
+    return result;
+}
+
 int ncp_read(int connection, void *data, int *length) {
-    ssize_t n;
-    type(WIRE_READ);
-    add(connection);
-    add(*length);
-    n = transact();
-    if(n == -1)
-        return -1;
-    if(message[1] != connection)
-        return -1;
-    memcpy(data, message + 2, n - 2);
-    *length = n - 2;
-    return 0;
+    struct ncp_op op;
+    int result;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_READ;
+    op.connection = connection;
+    op.buffer = data;
+    op.length = *length;
+    result = run(&op);
+    if(result == 0)
+        *length = op.length;
+    return result;
 }
 
 int ncp_write(int connection, void *data, int length) {
-    type(WIRE_WRITE);
-    add(connection);
-    memcpy(message + size, data, length);
-    size += length;
-    if(transact() == -1)
-        return -1;
-    if(message[1] != connection)
-        return -1;
-    return 0;
+    struct ncp_op op;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_WRITE;
+    op.connection = connection;
+    op.buffer = data;
+    op.length = length;
+    return run(&op);
+}
+
+static int simple(int type, int connection) {
+    struct ncp_op op;
+    memset(&op, 0, sizeof op);
+    op.type = type;
+    op.connection = connection;
+    return run(&op);
 }
 
 int ncp_interrupt(int connection) {
-    type(WIRE_INTERRUPT);
-    add(connection);
-    if(transact() == -1)
-        return -1;
-    if(message[1] != connection)
-        return -1;
-    return 0;
+    return simple(NCP_OP_INTERRUPT, connection);
 }
 
 int ncp_close(int connection) {
-    type(WIRE_CLOSE);
-    add(connection);
-    if(transact() == -1)
+    int result = simple(NCP_OP_CLOSE, connection);
+    map_destroy(connection); //Also when the NCP didn't answer.
+    return result;
+}
+
+int ncp_stream(int connection, int *fd) {
+    struct ncp_op op;
+    int result;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_STREAM;
+    op.connection = connection;
+    result = run(&op);
+    if(result == 0)
+        *fd = op.fd;
+    return result;
+}
+
+int ncp_map(int connection, int *fd) {
+    struct ncp_op op;
+    int result;
+    memset(&op, 0, sizeof op);
+    op.type = NCP_OP_MAP;
+    op.connection = connection;
+    result = run(&op);
+    if(result == 0)
+        *fd = op.fd;
+    return result;
+}
+
+/* Ask the NCP to signal the eventfd when it next moves the ring.    The
+   eventfd serves both rings, so emptying it may take a signal meant
+   for the other; signal it again for each ring waited on which is
+   already ready. */
+static void arm(struct map *m, int r) {
+    static const uint64_t one = 1;
+    uint64_t x;
+    int ready = 0;
+
+    m->waiting |= 1 << r;
+    if(read(m->fd, &x, sizeof x) == -1)
+        ; //Nothing signalled.
+    for(r = SHM_TX; r <= SHM_RX; r++) {
+        if((m->waiting & 1 << r) && shm_want(m->shm, r, r == SHM_TX)) {
+            m->waiting &= ~(1 << r);
+            ready = 1;
+        }
+    }
+    if(ready && write(m->fd, &one, sizeof one) == -1)
+        ; //Already readable.
+}
+
+int ncp_send(int connection, const void *data, int length) {
+    struct map *m = map_find(connection);
+    int n;
+
+    if(m == NULL) {
+        errno = EBADF;
         return -1;
-    if(message[1] != connection)
+    }
+    if(length <= 0) {
+        shm_end(m->shm, SHM_TX, m->signal);
+        return 0;
+    }
+    n = shm_put(m->shm, SHM_TX, data, length, m->signal);
+    if(n > 0) {
+        m->waiting &= ~(1 << SHM_TX);
+        return n;
+    }
+    arm(m, SHM_TX);
+    errno = EAGAIN;
+    return -1;
+}
+
+int ncp_recv(int connection, void *data, int length) {
+    struct map *m = map_find(connection);
+    int n, eof;
+
+    if(m == NULL) {
+        errno = EBADF;
         return -1;
-    return 0;
+    }
+    if(length <= 0)
+        return 0;
+    // Everything put before the end is there once it's seen.
+    eof = shm_eof(m->shm, SHM_RX);
+    n = shm_get(m->shm, SHM_RX, data, length, m->signal);
+    if(n > 0 || eof) {
+        m->waiting &= ~(1 << SHM_RX);
+        return n;
+    }
+    arm(m, SHM_RX);
+    errno = EAGAIN;
+    return -1;
 }
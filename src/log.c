@@ -0,0 +1,141 @@
+/* Logging for the NCP daemon.    Messages are collected in a buffer and
+     written to stderr by log_flush, which the event loop calls once per
+     pass.    It only writes as much as stderr takes without blocking; if
+     the buffer fills up, messages are dropped and counted. */
+
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_BUFFER (256 * 1024)
+#define LOG_LINE 1024 //Longest message, the rest is cut off.
+
+int log_level[LOG_SUBSYSTEMS] = { LOG_INFO, LOG_INFO, LOG_INFO };
+
+static char buffer[LOG_BUFFER];
+static int length;
+static unsigned long dropped;
+
+static const char *subsystem_name[LOG_SUBSYSTEMS] = { "imp", "ncp", "app" };
+static const char *level_name[] = { "error", "info", "debug", "trace" };
+
+static void append(const char *text, int n) {
+    if(n > LOG_BUFFER - length)
+        log_flush();
+    if(n > LOG_BUFFER - length) {
+        dropped++;
+        return;
+    }
+    memcpy(buffer + length, text, n);
+    length += n;
+}
+
+void log_printf(const char *format, ...) {
+    char line[LOG_LINE];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(line, sizeof line, format, ap);
+    va_end(ap);
+    if(n < 0)
+        return;
+    if(n >= sizeof line)
+        n = sizeof line - 1;
+    append(line, n);
+}
+
+static int write_some(int wait) {
+    struct pollfd p;
+    int n, done = 0;
+
+    p.fd = 2;
+    p.events = POLLOUT;
+    while(done < length) {
+        if(!wait && (poll(&p, 1, 0) != 1 || (p.revents & POLLOUT) == 0))
+            break;
+        n = length - done;
+        if(!wait && n > PIPE_BUF)
+            n = PIPE_BUF;
+        n = write(2, buffer + done, n);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += n;
+    }
+    memmove(buffer, buffer + done, length - done);
+    length -= done;
+    return done;
+}
+
+void log_flush(void) {
+    if(length > 0)
+        write_some(0);
+    if(dropped > 0 && length == 0) {
+        char line[64];
+        int n = snprintf(line, sizeof line,
+                         "LOG: %lu messages dropped.\n", dropped);
+        dropped = 0;
+        append(line, n);
+    }
+}
+
+// Write everything, waiting if need be.    Used on exit.
+void log_drain(void) {
+    log_flush();
+    write_some(1);
+}
+
+static int parse_level(const char *name, int n) {
+    int i;
+    if(n == 4 && strncmp(name, "none", 4) == 0)
+        return LOG_NONE;
+    for(i = 0; i <= LOG_TRACE; i++) {
+        if(strlen(level_name[i]) == n && strncmp(name, level_name[i], n) == 0)
+            return i;
+    }
+    if(n == 1 && name[0] >= '0' && name[0] <= '0' + LOG_TRACE)
+        return name[0] - '0';
+    return -2;
+}
+
+// Set levels from a list like "debug" or "imp=error,app=debug".
+// Returns -1 if the list is bad.
+int log_option(const char *spec) {
+    const char *end, *equal;
+    int i, n, level;
+
+    while(*spec != 0) {
+        end = strchr(spec, ',');
+        if(end == NULL)
+            end = spec + strlen(spec);
+        equal = memchr(spec, '=', end - spec);
+        if(equal == NULL) {
+            level = parse_level(spec, end - spec);
+            if(level == -2)
+                return -1;
+            for(i = 0; i < LOG_SUBSYSTEMS; i++)
+                log_level[i] = level;
+        } else {
+            n = equal - spec;
+            for(i = 0; i < LOG_SUBSYSTEMS; i++) {
+                if(strlen(subsystem_name[i]) == n
+                        && strncmp(spec, subsystem_name[i], n) == 0)
+                    break;
+            }
+            level = parse_level(equal + 1, end - equal - 1);
+            if(i == LOG_SUBSYSTEMS || level == -2)
+                return -1;
+            log_level[i] = level;
+        }
+        spec = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+/* Logging for the NCP daemon.    Each subsystem has its own level, and
+   a message is only formatted if its level is enabled.    Messages
+   above LOG_MAX are left out at compile time. */
+
+#define LOG_NONE  -1
+#define LOG_ERROR  0
+#define LOG_INFO   1
+#define LOG_DEBUG  2 //Every message.
+#define LOG_TRACE  3 //Every word of every message.
+
+#ifndef LOG_MAX
+#define LOG_MAX LOG_TRACE
+#endif
+
+#define LOG_IMP 0 //Host-IMP interface.
+#define LOG_NCP 1 //Host-host protocol.
+#define LOG_APP 2 //Applications.
+#define LOG_SUBSYSTEMS 3
+
+extern int log_level[LOG_SUBSYSTEMS];
+
+#define LOG_ENABLED(subsystem, level) \
+    ((level) <= LOG_MAX && (level) <= log_level[subsystem])
+
+#define LOG(subsystem, level, ...) \
+    do { \
+        if(LOG_ENABLED(subsystem, level)) \
+            log_printf(__VA_ARGS__); \
+    } while(0)
+
+extern void log_printf(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+extern int log_option(const char *spec);
+extern void log_flush(void);
+extern void log_drain(void);
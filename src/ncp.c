@@ -1,18 +1,28 @@
 /* Daemon implementing the ARPANET NCP.    Talks to the IMP interface
      and applications. */
 
+#include <poll.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/un.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "imp.h"
+#include "shm.h"
+#include "conn.h"
 #include "wire.h"
+#include "event.h"
+#include "timer.h"
+#include "log.h"
 
 #define IMP_REGULAR             0
 #define IMP_LEADER_ERROR    1
@@ -29,7 +39,6 @@
 #define LINK_CTL         0
 #define LINK_MIN         2
 #define LINK_MAX        71
-#define LINK_ECHO     72
 #define LINK_IP        155
 
 #define NCP_NOP            0
@@ -55,25 +64,33 @@
 #define ERR_SOCKET            4 //Request on a non-existent socket.
 #define ERR_CONNECT         5 //Socket(link) not connected.
 
-#define CONNECTIONS 20
-
 static int fd;
 static struct sockaddr_un server;
 static struct sockaddr_un client;
 static socklen_t len;
-
-struct {
-    struct sockaddr_un client;
-    socklen_t len;
-    int host;
-    struct { int link, size; uint32_t lsock, rsock; } rcv, snd;
-} connection[CONNECTIONS];
-
-struct {
-    struct sockaddr_un client;
-    socklen_t len;
-    uint32_t sock;
-} listening[CONNECTIONS];
+static uint32_t next_socket = 1002;
+static int rfnm_wait = 1;
+static int window = 8192; //Receive buffer budget per connection.
+static char *replay_file;
+static int replay_realtime;
+static volatile sig_atomic_t quit;
+
+#define ALLOC_MSGS 16
+#define HELD_MAX 4096 //Replies waiting for room at applications.
+#define PASS_MAX 3    //Descriptors passed with one reply.
+
+#define RETRIES 3
+
+#define NOP_INTERVAL     1000 //Milliseconds between NOPs to the IMP.
+#define RST_INTERVAL     2000 //Milliseconds between RSTs to a host.
+#define ECO_TIMEOUT     10000 //Milliseconds to wait for an ERP.
+#define RFC_TIMEOUT     60000 //Milliseconds to wait for a matching RFC.
+#define RFNM_TIMEOUT    30000 //Milliseconds to wait for a RFNM.
+#define CLS_TIMEOUT     30000 //Milliseconds to wait for a CLS to be confirmed.
+#define STATS_INTERVAL  60000 //Milliseconds between I/O statistics.
+#define REPLY_RETRY         1 //Milliseconds between tries to deliver a reply.
+
+static struct queue control[256];
 
 static const char *type_name[] = {
     "NOP", // 0
@@ -92,65 +109,117 @@ static const char *type_name[] = {
     "RRP"    // 13
 };
 
-static uint8_t packet[200];
-static uint8_t app[200];
-
-static int find_link(int host, int link) {
+static uint8_t packet[IMP_BUFFER];   //Outgoing IMP message.
+static uint8_t received[IMP_BUFFER]; //Incoming IMP message.
+static uint8_t request[WIRE_SIZE];
+static uint8_t *app;      //Request without its id and timeout.
+static uint32_t app_id;   //Id of the request, for the reply.
+static unsigned deadline; //Milliseconds the request may take, or 0.
+
+// Replies to the client of a batch, collected while it's processed.
+static int batching;
+static uint8_t batch[WIRE_SIZE];
+static int batch_size;
+
+// Data messages carry 40 bits of header before the text.
+#define TEXT_MAX ((IMP_MAX_BITS - 40) / 8)
+
+// Control commands not yet sent, per destination host.
+static struct {
+    int length, pending;
+    uint8_t data[TEXT_MAX];
+} commands[256];
+static uint8_t pending[256];
+static int pending_count;
+
+// Hosts to reset when the IMP first comes up, and for each one more
+// than the RSTs sent to it, until it answers.
+static uint8_t reset_list[256];
+static int reset_count;
+static uint8_t resetting[256];
+
+// Each link to a host has its own queue; link 0 carries control messages.
+static struct queue *link_queue(int host, int link) {
     int i;
-    for(i = 0; i < CONNECTIONS; i++) {
-        if(connection[i].host == host && connection[i].rcv.link == link)
-            return i;
-        if(connection[i].host == host && connection[i].snd.link == link)
-            return i;
+    if(link == LINK_CTL)
+        return &control[host];
+    i = conn_find_snd_link(host, link);
+    return i == -1 ? NULL : &connection[i].queue;
+}
+
+static void rfnm_timeout(int arg);
+static void close_connection(int i, unsigned ms);
+void ncp_cls(uint8_t destination, uint32_t lsock, uint32_t rsock);
+
+// Only one message per link may be in the network; the rest wait for
+// the RFNM.    Without an IMP there are no RFNMs, so don't wait.
+static void transmit(struct queue *q) {
+    while(q->head != NULL && !q->outstanding) {
+        imp_send_message(q->head->data, q->head->words);
+        if(!rfnm_wait) {
+            queue_drop(q);
+            continue;
+        }
+        q->outstanding = 1;
+        timer_stop(q->timer);
+        q->timer = timer_start(RFNM_TIMEOUT, rfnm_timeout,
+                               q->head->data[13] << 8 | q->head->data[14]);
     }
-    return -1;
 }
 
-static int find_socket(int host, uint32_t lsock) {
+// A send link has no more messages, delivered or given up on, so the CLS
+// put off until then can go.
+static void drained(struct queue *q, int host, int link) {
     int i;
-    for(i = 0; i < CONNECTIONS; i++) {
-        if(connection[i].host == host && connection[i].rcv.lsock == lsock)
-            return i;
-        if(connection[i].host == host && connection[i].snd.lsock == lsock)
-            return i;
-    }
-    return -1;
+    if(q->head != NULL || link == LINK_CTL)
+        return;
+    i = conn_find_snd_link(host, link);
+    if(i == -1 || !connection[i].closing)
+        return;
+    connection[i].closing = 0;
+    if(connection[i].snd.lsock != 0)
+        ncp_cls(connection[i].host, connection[i].snd.lsock, connection[i].snd.rsock);
 }
 
-static int find_sockets(int host, uint32_t lsock, uint32_t rsock) {
-    int i;
-    for(i = 0; i < CONNECTIONS; i++) {
-        if(connection[i].host == host && connection[i].rcv.lsock == lsock
-                && connection[i].rcv.rsock == rsock)
-            return i;
-        if(connection[i].host == host && connection[i].snd.lsock == lsock
-                && connection[i].snd.rsock == rsock)
-            return i;
+// Send the outstanding message again, or give up on it.
+static void retry(struct queue *q, int host, int link) {
+    if(q->retries++ < RETRIES) {
+        LOG(LOG_IMP, LOG_INFO, "NCP: Retransmitting to %03o link %u.\n", host, link);
+        q->outstanding = 0;
+    } else {
+        LOG(LOG_IMP, LOG_ERROR, "NCP: Giving up on message to %03o link %u.\n",
+                         host, link);
+        queue_drop(q);
     }
-    return -1;
+    transmit(q);
+    drained(q, host, link);
 }
 
-static int find_listen(uint32_t socket) {
-    int i;
-    for(i = 0; i < CONNECTIONS; i++) {
-        if(listening[i].sock == socket)
-            return i;
-        if(listening[i].sock + 1 == socket)
-            return i;
-    }
-    return -1;
+static void rfnm_timeout(int arg) {
+    struct queue *q = link_queue(arg >> 8, arg & 0xFF);
+    if(q == NULL || !q->outstanding)
+        return;
+    q->timer = 0;
+    LOG(LOG_IMP, LOG_INFO, "NCP: No RFNM from %03o link %u.\n", arg >> 8, arg & 0xFF);
+    retry(q, arg >> 8, arg & 0xFF);
 }
 
-
-static void destroy(int i) {
-    connection[i].host = connection[i].rcv.link = connection[i].snd.link =
-        connection[i].snd.size = connection[i].rcv.size = -1;
-    connection[i].rcv.lsock = connection[i].rcv.rsock =
-        connection[i].snd.lsock = connection[i].snd.rsock = 0;
+static void retransmit_all(void) {
+    int i;
+    for(i = 0; i < 256; i++) {
+        control[i].outstanding = 0;
+        transmit(&control[i]);
+    }
+    for(i = 0; i < connections; i++) {
+        connection[i].queue.outstanding = 0;
+        transmit(&connection[i].queue);
+    }
 }
 
 static void send_imp(int flags, int type, int destination, int link, int id,
                                             int subtype, void *data, int words) {
+    struct queue *q;
+
     packet[12] = flags << 4 | type;
     packet[13] = destination;
     packet[14] = link;
@@ -158,16 +227,18 @@ static void send_imp(int flags, int type, int destination, int link, int id,
     if(data != NULL)
         memcpy(packet + 16, data, 2 *(words - 2));
 
-#if 1
-    {
+    if(LOG_ENABLED(LOG_IMP, LOG_TRACE)) {
         int i;
         for(i = 12; i < 12 + 2*words; i += 2)
-            fprintf(stderr, " <<< %06o(%03o %03o)\n",
-                            (packet[i] << 8) | packet[i+1], packet[i], packet[i+1]);
+            log_printf(" <<< %06o(%03o %03o)\n",
+                       (packet[i] << 8) | packet[i+1], packet[i], packet[i+1]);
     }
-#endif
 
-    imp_send_message(packet, words);
+    if(type == IMP_REGULAR &&(q = link_queue(destination, link)) != NULL) {
+        queue_put(q, packet, words);
+        transmit(q);
+    } else
+        imp_send_message(packet, words);
 }
 
 static void send_leader_error(int subtype) {
@@ -182,35 +253,52 @@ static void send_reset(void) {
     send_imp(0, IMP_RESET, 0, 0, 0, 0, NULL, 2);
 }
 
-static void send_ncp(uint8_t destination, uint8_t byte, uint16_t count,
-                                            uint8_t type) {
+// Send queued control commands to a host as one message on link 0.
+static void flush_commands(int host) {
+    int count = commands[host].length;
     packet[16] = 0;
-    packet[17] = byte;
+    packet[17] = 8;
     packet[18] = count >> 8;
     packet[19] = count;
     packet[20] = 0;
-    packet[21] = type;
-    fprintf(stderr, "NCP: send to %03o, type %d/%s.\n",
-                     destination, type, type <= NCP_MAX ? type_name[type] : "???");
-    send_imp(0, IMP_REGULAR, destination, 0, 0, 0, NULL,(count + 9 + 1)/2);
+    memcpy(packet + 21, commands[host].data, count);
+    commands[host].length = 0;
+    send_imp(0, IMP_REGULAR, host, LINK_CTL, 0, 0, NULL, (count + 9 + 1)/2);
+}
+
+// Called at the end of each event loop iteration.    While link 0 to a
+// host waits for a RFNM, its commands are held so more can be packed in.
+static void flush_all_commands(void) {
+    int i, host, n = 0;
+    for(i = 0; i < pending_count; i++) {
+        host = pending[i];
+        if(commands[host].length == 0)
+            commands[host].pending = 0;
+        else if(control[host].head != NULL)
+            pending[n++] = host;
+        else {
+            flush_commands(host);
+            commands[host].pending = 0;
+        }
+    }
+    pending_count = n;
 }
 
-static int make_open(int host,
-                                            uint32_t rcv_lsock, uint32_t rcv_rsock,
-                                            uint32_t snd_lsock, uint32_t snd_rsock) {
-    int i = find_link(-1, -1);
-    if(i == -1) {
-        fprintf(stderr, "NCP: Table full.\n");
-        return -1;
+static void send_ncp(uint8_t destination, uint16_t count, uint8_t type) {
+    uint8_t command[12];
+    packet[21] = type;
+    memcpy(command, packet + 21, count);
+    LOG(LOG_NCP, LOG_DEBUG, "NCP: send to %03o, type %d/%s.\n",
+                     destination, type, type <= NCP_MAX ? type_name[type] : "???");
+    if(commands[destination].length + count > TEXT_MAX)
+        flush_commands(destination);
+    memcpy(commands[destination].data + commands[destination].length,
+           command, count);
+    commands[destination].length += count;
+    if(!commands[destination].pending) {
+        commands[destination].pending = 1;
+        pending[pending_count++] = destination;
     }
-
-    connection[i].host = host;
-    connection[i].rcv.lsock = rcv_lsock;
-    connection[i].rcv.rsock = rcv_rsock;
-    connection[i].snd.lsock = snd_lsock;
-    connection[i].snd.rsock = snd_rsock;
-
-    return i;
 }
 
 // Sender to receiver.
@@ -224,7 +312,7 @@ void ncp_str(uint8_t destination, uint32_t lsock, uint32_t rsock, uint8_t size)
     packet[28] = rsock >> 8;
     packet[29] = rsock;
     packet[30] = size;
-    send_ncp(destination, 8, 10, NCP_STR);
+    send_ncp(destination, 10, NCP_STR);
 }
 
 // Receiver to sender.
@@ -238,31 +326,31 @@ void ncp_rts(uint8_t destination, uint32_t lsock, uint32_t rsock, uint8_t link)
     packet[28] = rsock >> 8;
     packet[29] = rsock;
     packet[30] = link;
-    send_ncp(destination, 8, 10, NCP_RTS);
+    send_ncp(destination, 10, NCP_RTS);
 }
 
 // Allocate.
 void ncp_all(uint8_t destination, uint8_t link, uint16_t msg_space, uint32_t bit_space) {
     packet[22] = link;
-    packet[23] = msg_space >> 16;
+    packet[23] = msg_space >> 8;
     packet[24] = msg_space;
     packet[25] = bit_space >> 24;
     packet[26] = bit_space >> 16;
     packet[27] = bit_space >> 8;
     packet[28] = bit_space;
-    send_ncp(destination, 8, 8, NCP_ALL);
+    send_ncp(destination, 8, NCP_ALL);
 }
 
 // Return.
 void ncp_ret(uint8_t destination, uint8_t link, uint16_t msg_space, uint32_t bit_space) {
     packet[22] = link;
-    packet[23] = msg_space >> 16;
+    packet[23] = msg_space >> 8;
     packet[24] = msg_space;
     packet[25] = bit_space >> 24;
     packet[26] = bit_space >> 16;
     packet[27] = bit_space >> 8;
     packet[28] = bit_space;
-    send_ncp(destination, 8, 8, NCP_RET);
+    send_ncp(destination, 8, NCP_RET);
 }
 
 // Give back.
@@ -270,19 +358,19 @@ void ncp_gvb(uint8_t destination, uint8_t link, uint8_t fm, uint8_t fb) {
     packet[22] = link;
     packet[23] = fm;
     packet[24] = fb;
-    send_ncp(destination, 8, 4, NCP_GVB);
+    send_ncp(destination, 4, NCP_GVB);
 }
 
 // Interrupt by receiver.
 void ncp_inr(uint8_t destination, uint8_t link) {
     packet[22] = link;
-    send_ncp(destination, 8, 2, NCP_INR);
+    send_ncp(destination, 2, NCP_INR);
 }
 
 // Interrupt by sender.
 void ncp_ins(uint8_t destination, uint8_t link) {
     packet[22] = link;
-    send_ncp(destination, 8, 2, NCP_INS);
+    send_ncp(destination, 2, NCP_INS);
 }
 
 // Close.
@@ -295,35 +383,35 @@ void ncp_cls(uint8_t destination, uint32_t lsock, uint32_t rsock) {
     packet[27] = rsock >> 16;
     packet[28] = rsock >> 8;
     packet[29] = rsock;
-    send_ncp(destination, 8, 9, NCP_CLS);
+    send_ncp(destination, 9, NCP_CLS);
 }
 
 // Echo.
 void ncp_eco(uint8_t destination, uint8_t data) {
     memset(packet, 0, sizeof packet);
     packet[22] = data;
-    send_ncp(destination, 8, 2, NCP_ECO);
+    send_ncp(destination, 2, NCP_ECO);
 }
 
 // Echo reply.
 void ncp_erp(uint8_t destination, uint8_t data) {
     packet[22] = data;
-    send_ncp(destination, 8, 2, NCP_ERP);
+    send_ncp(destination, 2, NCP_ERP);
 }
 
 // Reset.
 void ncp_rst(uint8_t destination) {
-    send_ncp(destination, 8, 1, NCP_RST);
+    send_ncp(destination, 1, NCP_RST);
 }
 
 // Reset reply.
 void ncp_rrp(uint8_t destination) {
-    send_ncp(destination, 8, 1, NCP_RRP);
+    send_ncp(destination, 1, NCP_RRP);
 }
 
 // No operation.
 void ncp_nop(uint8_t destination) {
-    send_ncp(destination, 8, 1, NCP_NOP);
+    send_ncp(destination, 1, NCP_NOP);
 }
 
 // Error.
@@ -332,7 +420,7 @@ void ncp_err(uint8_t destination, uint8_t code, void *data, int length) {
     memcpy(packet + 23, data, length > 10 ? 10 : length);
     if(length < 10)
         memset(packet + 23 + length, 0, 10 - length);
-    send_ncp(destination, 8, 12, NCP_ERR);
+    send_ncp(destination, 12, NCP_ERR);
 }
 
 static int process_nop(uint8_t source, uint8_t *data) {
@@ -348,50 +436,657 @@ static uint32_t sock(uint8_t *data) {
     return x;
 }
 
-static void reply_open(uint8_t host, uint32_t socket, uint8_t connection) {
-    uint8_t reply[7];
+// A reply for which the application's socket had no room.
+struct held {
+    struct held *next;
+    struct sockaddr_un to;
+    socklen_t tolen;
+    int pass[PASS_MAX]; //Descriptors passed with the reply,
+    int passes;         //how many.
+    int n;
+    uint8_t data[];
+};
+
+static struct held *held, **held_tail = &held;
+static int held_count, held_timer;
+
+// Send a reply, passing descriptors with it.
+static int send_frame(struct sockaddr_un *to, socklen_t tolen,
+                      uint8_t *frame, int n, const int *pass, int passes) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(PASS_MAX * sizeof(int))];
+    } control;
+    struct cmsghdr *c;
+    struct msghdr m;
+    struct iovec v;
+
+    if(passes == 0)
+        return sendto(fd, frame, n, MSG_DONTWAIT,(struct sockaddr *)to, tolen);
+    v.iov_base = frame;
+    v.iov_len = n;
+    memset(&m, 0, sizeof m);
+    m.msg_name = to;
+    m.msg_namelen = tolen;
+    m.msg_iov = &v;
+    m.msg_iovlen = 1;
+    m.msg_control = control.data;
+    m.msg_controllen = CMSG_SPACE(passes * sizeof(int));
+    c = CMSG_FIRSTHDR(&m);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(passes * sizeof(int));
+    memcpy(CMSG_DATA(c), pass, passes * sizeof(int));
+    return sendmsg(fd, &m, MSG_DONTWAIT);
+}
+
+static void close_all(const int *pass, int passes) {
+    int i;
+    for(i = 0; i < passes; i++)
+        close(pass[i]);
+}
+
+static void held_timeout(int arg) {
+    struct held *h, **p = &held;
+    held_timer = 0;
+    while((h = *p) != NULL) {
+        if(send_frame(&h->to, h->tolen, h->data, h->n, h->pass, h->passes) == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                p = &h->next;
+                continue;
+            }
+            LOG(LOG_APP, LOG_ERROR, "NCP: sendto %s error: %s.\n",
+                             h->to.sun_path, strerror(errno));
+        }
+        close_all(h->pass, h->passes);
+        *p = h->next;
+        free(h);
+        held_count--;
+    }
+    held_tail = p;
+    if(held != NULL)
+        held_timer = timer_start(REPLY_RETRY, held_timeout, 0);
+}
+
+// An application with many requests outstanding may not keep up with
+// the replies; keep them until it does.
+static void hold(struct sockaddr_un *to, socklen_t tolen,
+                 uint8_t *frame, int n, const int *pass, int passes) {
+    struct held *h = NULL;
+    if(held_count < HELD_MAX)
+        h = malloc(sizeof *h + n);
+    if(h == NULL) {
+        LOG(LOG_APP, LOG_ERROR, "NCP: Reply to %s dropped.\n", to->sun_path);
+        close_all(pass, passes);
+        return;
+    }
+    memcpy(&h->to, to, tolen);
+    h->tolen = tolen;
+    memcpy(h->pass, pass, passes * sizeof *pass);
+    h->passes = passes;
+    h->n = n;
+    memcpy(h->data, frame, n);
+    h->next = NULL;
+    *held_tail = h;
+    held_tail = &h->next;
+    held_count++;
+    if(held_timer == 0)
+        held_timer = timer_start(REPLY_RETRY, held_timeout, 0);
+}
+
+// Send a frame, or hold it if the application isn't keeping up.
+// Passed descriptors are closed once they're sent.
+static void send_or_hold(struct sockaddr_un *to, socklen_t tolen,
+                         uint8_t *frame, int n, const int *pass, int passes) {
+    if(send_frame(to, tolen, frame, n, pass, passes) == -1) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            hold(to, tolen, frame, n, pass, passes);
+            return;
+        }
+        LOG(LOG_APP, LOG_ERROR, "NCP: sendto %s error: %s.\n",
+                         to->sun_path, strerror(errno));
+    }
+    close_all(pass, passes);
+}
+
+static void batch_start(uint32_t id) {
+    batch[0] = WIRE_BATCH+1;
+    batch[1] = id >> 24;
+    batch[2] = id >> 16;
+    batch[3] = id >> 8;
+    batch[4] = id;
+    batch_size = 1 + WIRE_ID_SIZE;
+    batching = 1;
+}
+
+static void batch_flush(void) {
+    if(batch_size > 1 + WIRE_ID_SIZE)
+        send_or_hold(&client, len, batch, batch_size, NULL, 0);
+    batch_size = 1 + WIRE_ID_SIZE;
+}
+
+// Put the id of the request after the type of the reply.    Replies to
+// the client of a batch go with the others in one frame.
+static void send_pass(struct sockaddr_un *to, socklen_t tolen, uint32_t id,
+                      uint8_t *reply, int n, const int *pass, int passes) {
+    static uint8_t single[WIRE_SIZE];
+    uint8_t *frame = single;
+    int batched = batching && passes == 0 && tolen == len &&
+        memcmp(to, &client, tolen) == 0 &&
+        3 + 2 * WIRE_ID_SIZE + n <= WIRE_SIZE; //Fits in a batch of its own.
+    if(batched) {
+        if(batch_size + 2 + n + WIRE_ID_SIZE > WIRE_SIZE)
+            batch_flush();
+        batch[batch_size++] = (n + WIRE_ID_SIZE) >> 8;
+        batch[batch_size++] = n + WIRE_ID_SIZE;
+        frame = batch + batch_size;
+    }
+    frame[0] = reply[0];
+    frame[1] = id >> 24;
+    frame[2] = id >> 16;
+    frame[3] = id >> 8;
+    frame[4] = id;
+    memcpy(frame + 1 + WIRE_ID_SIZE, reply + 1, n - 1);
+    n += WIRE_ID_SIZE;
+    if(batched)
+        batch_size += n;
+    else
+        send_or_hold(to, tolen, frame, n, pass, passes);
+}
+
+static void send_to(struct sockaddr_un *to, socklen_t tolen, uint32_t id,
+                    uint8_t *reply, int n) {
+    send_pass(to, tolen, id, reply, n, NULL, 0);
+}
+
+// The request on a connection which a reply answers.
+static uint32_t reply_id(int i, uint8_t type) {
+    switch(type) {
+    case WIRE_READ+1: return connection[i].read_id;
+    case WIRE_WRITE+1: return connection[i].write_id;
+    default: return connection[i].open_id;
+    }
+}
+
+// Replies about a connection go to the application owning it, others
+// to the application whose request is being processed.
+static void send_reply(int i, uint8_t *reply, int n) {
+    if(i == -1)
+        send_to(&client, len, app_id, reply, n);
+    else if(connection[i].len != 0)
+        send_to(&connection[i].client, connection[i].len,
+                reply_id(i, reply[0]), reply, n);
+}
+
+static void reply_open(int i, uint8_t host, uint32_t socket, uint16_t number) {
+    uint8_t reply[8];
     reply[0] = WIRE_OPEN+1;
     reply[1] = host;
     reply[2] = socket >> 24;
     reply[3] = socket >> 16;
     reply[4] = socket >> 8;
     reply[5] = socket;
-    reply[6] = connection;
-    if(sendto(fd, reply, sizeof reply, 0,(struct sockaddr *)&client, len) == -1)
-        fprintf(stderr, "NCP: sendto %s error: %s.\n",
-                         client.sun_path, strerror(errno));
+    reply[6] = number >> 8;
+    reply[7] = number;
+    send_reply(i, reply, sizeof reply);
 }
 
-static void reply_listen(uint8_t host, uint32_t socket, uint8_t connection) {
-    uint8_t reply[7];
+static void reply_listen(struct sockaddr_un *to, socklen_t tolen, uint32_t id,
+                         uint8_t host, uint32_t socket, uint16_t number) {
+    uint8_t reply[8];
     reply[0] = WIRE_LISTEN+1;
     reply[1] = host;
     reply[2] = socket >> 24;
     reply[3] = socket >> 16;
     reply[4] = socket >> 8;
     reply[5] = socket;
-    reply[6] = connection;
-    if(sendto(fd, reply, sizeof reply, 0,(struct sockaddr *)&client, len) == -1)
-        fprintf(stderr, "NCP: sendto %s error: %s.\n",
-                         client.sun_path, strerror(errno));
+    reply[6] = number >> 8;
+    reply[7] = number;
+    send_to(to, tolen, id, reply, sizeof reply);
 }
 
-static void reply_close(uint8_t connection) {
-    uint8_t reply[2];
+static void reply_close(int i) {
+    uint8_t reply[3];
     reply[0] = WIRE_CLOSE+1;
-    reply[1] = connection;
-    if(sendto(fd, reply, sizeof reply, 0,(struct sockaddr *)&client, len) == -1)
-        fprintf(stderr, "NCP: sendto %s error: %s.\n",
-                         client.sun_path, strerror(errno));
+    reply[1] = i >> 8;
+    reply[2] = i;
+    send_reply(i, reply, sizeof reply);
+}
+
+// Answer a read with up to n octets from the connection's ring.
+static void reply_read(int i, int n) {
+    static uint8_t reply[3 + WIRE_DATA];
+    reply[0] = WIRE_READ+1;
+    reply[1] = i >> 8;
+    reply[2] = i;
+    n = ring_get(&connection[i].in, reply + 3, n);
+    send_reply(i, reply, n + 3);
+}
+
+static void reply_write(int i) {
+    uint8_t reply[3];
+    reply[0] = WIRE_WRITE+1;
+    reply[1] = i >> 8;
+    reply[2] = i;
+    send_reply(i, reply, sizeof reply);
+}
+
+// Tell the application a request on a connection failed, CONN_MAX, or
+// took too long, CONN_TIMEOUT.
+static void reply_error(int i, uint8_t type, uint16_t error) {
+    uint8_t reply[3];
+    reply[0] = type+1;
+    reply[1] = error >> 8;
+    reply[2] = error & 0xFF;
+    send_reply(i, reply, sizeof reply);
+}
+
+static void reply_interrupt(int i) {
+    uint8_t reply[3];
+    reply[0] = WIRE_INTERRUPT+1;
+    reply[1] = i >> 8;
+    reply[2] = i;
+    send_reply(-1, reply, sizeof reply);
+}
+
+static void stop_timer(int *timer) {
+    timer_stop(*timer);
+    *timer = 0;
+}
+
+static void stream_close(int i) {
+    if(connection[i].stream == -1)
+        return;
+    event_remove(connection[i].stream);
+    close(connection[i].stream);
+    connection[i].stream = -1;
+}
+
+static void unmap(int i) {
+    struct connection *c = &connection[i];
+    if(c->shm == NULL)
+        return;
+    event_remove(c->shm_event);
+    close(c->shm_event);
+    close(c->shm_signal);
+    shm_unmap(c->shm);
+    c->shm = NULL;
+}
+
+static void destroy(int i) {
+    stream_close(i);
+    unmap(i);
+    conn_destroy(i);
+}
+
+// Data written by the application and not yet sent.
+static int unsent(struct connection *c) {
+    return c->shm != NULL ? shm_length(c->shm, SHM_TX) : c->out.length;
+}
+
+// Data received and not yet taken by the application.
+static int unread(struct connection *c) {
+    return c->shm != NULL ? shm_length(c->shm, SHM_RX) : c->in.length;
+}
+
+// Watch the stream for room while data waits for it, and for more data
+// while there's room in the output buffer.
+static void stream_watch(int i) {
+    struct connection *c = &connection[i];
+    int events = 0;
+    if(c->stream == -1)
+        return;
+    if(c->in.length > 0)
+        events |= EVENT_WRITE;
+    if(c->out.length < window && !c->stream_eof)
+        events |= EVENT_READ;
+    if(events != c->stream_events) {
+        event_watch(c->stream, events);
+        c->stream_events = events;
+    }
+}
+
+// The time a request may wait for something, at most ms.
+static unsigned limit(unsigned ms) {
+    return deadline != 0 && deadline < ms ? deadline : ms;
+}
+
+// The application shut its stream down for writing and all of it is
+// sent, so close the send link but leave the receive link open.
+static void shut_send(int i) {
+    struct connection *c = &connection[i];
+    LOG(LOG_NCP, LOG_INFO, "NCP: Closing send link of connection %u.\n", i);
+    c->shut = 1;
+    c->snd.size = -1;
+    if(c->queue.head != NULL)
+        c->closing = 1;
+    else if(c->snd.lsock != 0)
+        ncp_cls(c->host, c->snd.lsock, c->snd.rsock);
+}
+
+// Send as much written data as the allocation permits, in messages as
+// large as the IMP takes.    Returns the octets taken from out.
+static int send_messages(struct connection *c) {
+    int n, sent = 0;
+    while(c->snd.msgs > 0 && c->snd.bits >= 8) {
+        n = c->shm != NULL ? shm_length(c->shm, SHM_TX) : c->out.length - sent;
+        if(n == 0)
+            break;
+        if(n > c->snd.bits / 8)
+            n = c->snd.bits / 8;
+        if(n > TEXT_MAX)
+            n = TEXT_MAX;
+        packet[16] = 0;
+        packet[17] = 8;
+        packet[18] = n >> 8;
+        packet[19] = n;
+        packet[20] = 0;
+        if(c->shm != NULL)
+            shm_get(c->shm, SHM_TX, packet + 21, n, c->shm_signal);
+        else {
+            memcpy(packet + 21, c->out.data + sent, n);
+            sent += n;
+        }
+        send_imp(0, IMP_REGULAR, c->host, c->snd.link, 0, 0, NULL,
+                 2 + (5 + n + 1) / 2);
+        c->snd.msgs--;
+        c->snd.bits -= 8 * n;
+    }
+    return sent;
+}
+
+// The write is complete when all of it has been handed to the IMP.
+static void send_data(int i) {
+    struct connection *c = &connection[i];
+    if(c->shm != NULL) {
+        // Seen before what was put ahead of it.
+        if(shm_eof(c->shm, SHM_TX))
+            c->stream_eof = 1;
+        if(c->eof)
+            shm_get(c->shm, SHM_TX, NULL, c->shm->size, c->shm_signal);
+    }
+    buffer_remove(&c->out, send_messages(c));
+    // With allocation to spare, be told when the application puts more.
+    while(c->shm != NULL && !c->eof && c->snd.msgs > 0 && c->snd.bits >= 8 &&
+          shm_want(c->shm, SHM_TX, 0) && shm_length(c->shm, SHM_TX) > 0)
+        send_messages(c);
+    if(c->out.length == 0 && c->writing) {
+        c->writing = 0;
+        stop_timer(&c->write_timer);
+        reply_write(i);
+    }
+    if(unsent(c) == 0 && c->draining) {
+        c->draining = 0;
+        close_connection(i, CLS_TIMEOUT);
+        return;
+    }
+    if(unsent(c) == 0 && c->stream_eof && !c->shut && !c->eof &&
+       (c->stream != -1 || c->shm != NULL))
+        shut_send(i);
+    stream_watch(i);
+}
+
+// Keep the sender's allocation topped up to the free space in the
+// receive ring, but only bother once half of it has been used.    Returns
+// 0 if the application needs to make room first.
+static int allocate(int i) {
+    struct connection *c = &connection[i];
+    int space = window - unread(c) - c->rcv.bits / 8;
+    int msgs = ALLOC_MSGS - c->rcv.msgs;
+    if(c->eof || c->rcv_eof)
+        return 1;
+    if(space < window / 2 && msgs < ALLOC_MSGS / 2)
+        return 0;
+    if(space < 0)
+        space = 0;
+    if(msgs < 0)
+        msgs = 0;
+    c->rcv.msgs += msgs;
+    c->rcv.bits += 8 * space;
+    ncp_all(c->host, c->rcv.link, msgs, 8 * space);
+    return 1;
+}
+
+// Pass on what came from the remote to the stream, and tell the
+// application when there won't be more.
+static void stream_out(int i) {
+    struct connection *c = &connection[i];
+    if(ring_write(&c->in, c->stream) > 0)
+        allocate(i);
+    if((c->eof || c->rcv_eof) && c->in.length == 0)
+        shutdown(c->stream, SHUT_WR);
+    stream_watch(i);
+}
+
+// Satisfy a pending read from the receive ring.    Once the remote has
+// closed, or closed its side, and the ring is empty, reads return nothing.
+static void deliver(int i) {
+    struct connection *c = &connection[i];
+    if(c->stream != -1) {
+        stream_out(i);
+        return;
+    }
+    // The data is in the shared ring already; allocate more once the
+    // application has taken enough of it.
+    if(c->shm != NULL) {
+        if(c->eof || c->rcv_eof)
+            shm_end(c->shm, SHM_RX, c->shm_signal);
+        else if(!allocate(i) && shm_want(c->shm, SHM_RX, 1))
+            allocate(i);
+        return;
+    }
+    if(c->reading == 0)
+        return;
+    if(c->in.length == 0 && !c->eof && !c->rcv_eof)
+        return;
+    reply_read(i, c->reading);
+    c->reading = 0;
+    stop_timer(&c->read_timer);
+    allocate(i);
+}
+
+// The remote closed the connection.    Keep it around until the
+// application has read what's left and closes it too.
+static void remote_closed(int i) {
+    struct connection *c = &connection[i];
+    c->eof = 1;
+    conn_set_link(i, &c->rcv, -1);
+    conn_set_link(i, &c->snd, -1);
+    queue_clear(&c->queue);
+    buffer_free(&c->out);
+    if(c->writing) {
+        c->writing = 0;
+        stop_timer(&c->write_timer);
+        reply_write(i);
+    }
+    if(c->draining) {
+        c->draining = 0;
+        close_connection(i, CLS_TIMEOUT);
+        return;
+    }
+    deliver(i);
+    if(c->shm != NULL)
+        send_data(i); //Throws away what the application put.
+}
+
+// Fail the requests still waiting on a connection which goes away.
+static void cancel(int i) {
+    struct connection *c = &connection[i];
+    if(c->opening)
+        reply_open(i, c->host, c->rcv.rsock, CONN_MAX);
+    if(c->reading)
+        reply_error(i, WIRE_READ, CONN_MAX);
+    if(c->writing)
+        reply_error(i, WIRE_WRITE, CONN_MAX);
+    c->opening = c->reading = c->writing = 0;
+    stop_timer(&c->read_timer);
+    stop_timer(&c->write_timer);
+}
+
+// Take what the application wrote to its stream while there's room.
+// Once the remote has closed, it's thrown away.
+static void stream_in(int i) {
+    struct connection *c = &connection[i];
+    int n;
+    while(c->out.length < window) {
+        n = buffer_read(&c->out, c->stream, window);
+        if(n > 0 && c->eof)
+            buffer_remove(&c->out, n);
+        if(n > 0)
+            continue;
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            c->stream_eof = 1;
+        break;
+    }
+    send_data(i);
+}
+
+// Whether the application closed its end of the stream, rather than
+// only shutting it down for writing.
+static int hung_up(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = 0;
+    return poll(&p, 1, 0) == 1 && (p.revents & POLLHUP);
+}
+
+// The application is done with the stream, and with the connection
+// once what it wrote is sent.    There's nobody to tell when it's closed.
+static void stream_hangup(int i) {
+    struct connection *c = &connection[i];
+    LOG(LOG_APP, LOG_INFO, "NCP: Stream of connection %u closed.\n", i);
+    stream_close(i);
+    c->len = 0;
+    if(c->out.length == 0 || c->eof)
+        close_connection(i, CLS_TIMEOUT);
+    else
+        c->draining = 1;
+}
+
+static void stream_event(int i) {
+    struct connection *c = &connection[i];
+    if(c->stream == -1)
+        return;
+    if(c->in.length > 0)
+        stream_out(i);
+    if(!c->stream_eof)
+        stream_in(i);
+    if(c->stream_eof && hung_up(c->stream))
+        stream_hangup(i);
+}
+
+// Pick a receive link not in use by any connection to the host.
+static int new_link(int host) {
+    int link;
+    for(link = LINK_MIN; link <= LINK_MAX; link++) {
+        if(conn_find_rcv_link(host, link) == -1)
+            return link;
+    }
+    return -1;
+}
+
+// Pick a fresh pair of local sockets, receive even and send odd.
+static uint32_t new_sockets(int host) {
+    uint32_t socket;
+    do {
+        socket = next_socket;
+        next_socket += 2;
+        if(next_socket < 1002)
+            next_socket = 1002;
+    } while(conn_find_socket(host, socket) != -1 ||
+            conn_find_socket(host, socket + 1) != -1);
+    return socket;
+}
+
+// An incoming RFC satisfies a listen; hand it the listener's client.
+static void accept_listen(int l, int i) {
+    if(l == -1)
+        return;
+    memcpy(&connection[i].client, &listening[l].client, listening[l].len);
+    connection[i].len = listening[l].len;
+    connection[i].open_id = listening[l].id;
+    listen_destroy(l);
+}
+
+// An RFC which isn't matched in time is aborted.
+static void rfc_timeout(int i) {
+    connection[i].timer = 0;
+    LOG(LOG_NCP, LOG_INFO, "NCP: RFC on connection %d timed out.\n", i);
+    if(connection[i].rcv.lsock != 0)
+        ncp_cls(connection[i].host, connection[i].rcv.lsock,
+                         connection[i].rcv.rsock);
+    if(connection[i].snd.lsock != 0)
+        ncp_cls(connection[i].host, connection[i].snd.lsock,
+                         connection[i].snd.rsock);
+    destroy(i);
+}
+
+static void open_timeout(int i) {
+    reply_open(i, connection[i].host, connection[i].rcv.rsock, CONN_TIMEOUT);
+    rfc_timeout(i);
+}
+
+static void listen_timeout(int l) {
+    listening[l].timer = 0;
+    LOG(LOG_APP, LOG_INFO, "NCP: Listen to %u timed out.\n", listening[l].sock);
+    reply_listen(&listening[l].client, listening[l].len, listening[l].id, 0,
+                 listening[l].sock, CONN_TIMEOUT);
+    listen_destroy(l);
+}
+
+static void read_timeout(int i) {
+    connection[i].read_timer = 0;
+    connection[i].reading = 0;
+    LOG(LOG_APP, LOG_INFO, "NCP: Read on connection %u timed out.\n", i);
+    reply_error(i, WIRE_READ, CONN_TIMEOUT);
+}
+
+// The written data is still sent when the allocation comes.
+static void write_timeout(int i) {
+    connection[i].write_timer = 0;
+    connection[i].writing = 0;
+    LOG(LOG_APP, LOG_INFO, "NCP: Write on connection %u timed out.\n", i);
+    reply_error(i, WIRE_WRITE, CONN_TIMEOUT);
+}
+
+// The remote didn't confirm closing; forget the connection anyway.
+static void close_timeout(int i) {
+    connection[i].timer = 0;
+    LOG(LOG_NCP, LOG_INFO, "NCP: Close of connection %u timed out.\n", i);
+    reply_error(i, WIRE_CLOSE, CONN_TIMEOUT);
+    destroy(i);
+}
+
+// Close a connection, waiting at most ms for the remote to confirm.
+static void close_connection(int i, unsigned ms) {
+    if(connection[i].eof) {
+        reply_close(i);
+        destroy(i);
+        return;
+    }
+    connection[i].snd.size = connection[i].rcv.size = -1;
+    // Either side may already be closed on its own.
+    if(connection[i].rcv.lsock != 0)
+        ncp_cls(connection[i].host, connection[i].rcv.lsock, connection[i].rcv.rsock);
+    // Control commands don't wait for data, so the CLS would overtake
+    // messages still queued on the send link.
+    if(connection[i].shut)
+        ;
+    else if(connection[i].queue.head != NULL)
+        connection[i].closing = 1;
+    else
+        ncp_cls(connection[i].host, connection[i].snd.lsock, connection[i].snd.rsock);
+    stop_timer(&connection[i].timer);
+    connection[i].timer = timer_start(ms, close_timeout, i);
 }
 
 static int process_rts(uint8_t source, uint8_t *data) {
-    int i;
+    int i, l;
     uint32_t lsock, rsock;
     rsock = sock(&data[0]);
     lsock = sock(&data[4]);
 
-    fprintf(stderr, "NCP: Recieved RTS %u:%u from %03o.\n",
+    LOG(LOG_NCP, LOG_INFO, "NCP: Recieved RTS %u:%u from %03o.\n",
                      lsock, rsock, source);
 
     if(data[8] < LINK_MIN || data[8] > LINK_MAX) {
@@ -399,37 +1094,50 @@ static int process_rts(uint8_t source, uint8_t *data) {
         return 9;
     }
 
-    if(find_listen(lsock) == -1) {
-        i = find_sockets(source, lsock, rsock);
+    l = listen_find(lsock);
+    if(l == -1) {
+        i = conn_find_sockets(source, lsock, rsock);
         if(i == -1) {
-            fprintf(stderr, "NCP: Not listening to %u, no outgoing RFC, rejecting.\n", lsock);
+            LOG(LOG_NCP, LOG_INFO, "NCP: Not listening to %u, no outgoing RFC, rejecting.\n", lsock);
             ncp_err(source, ERR_CONNECT, data - 1, 10);
             return 9;
         }
-        fprintf(stderr, "NCP: Outgoing RFC socket %u.\n", lsock);
+        LOG(LOG_NCP, LOG_DEBUG, "NCP: Outgoing RFC socket %u.\n", lsock);
     } else {
-        i = find_socket(source, lsock + 1);
+        i = conn_find_sockets(source, lsock + 1, rsock + 1);
         if(i == -1) {
-            i = make_open(source, 0, 0, lsock, rsock);
-            fprintf(stderr, "NCP: Listening to %u: new connection %d.\n", lsock, i);
+            i = conn_make(source, 0, 0, lsock, rsock);
+            if(i == -1) {
+                ncp_cls(source, lsock, rsock);
+                return 9;
+            }
+            connection[i].timer = timer_start(RFC_TIMEOUT, rfc_timeout, i);
+            LOG(LOG_NCP, LOG_DEBUG, "NCP: Listening to %u: new connection %d.\n", lsock, i);
         } else {
-            connection[i].snd.lsock = lsock;
-            connection[i].snd.rsock = rsock;
-            fprintf(stderr, "NCP: Listening to %u: connection %d.\n", lsock, i);
+            conn_set_sockets(i, &connection[i].snd, lsock, rsock);
+            LOG(LOG_NCP, LOG_DEBUG, "NCP: Listening to %u: connection %d.\n", lsock, i);
         }
     }
-    connection[i].snd.link = data[8]; //Send link.
+    conn_set_link(i, &connection[i].snd, data[8]); //Send link.
     if(connection[i].rcv.size == -1) {
         connection[i].rcv.size = 8; //Send byte size.
         ncp_str(connection[i].host, lsock, rsock, connection[i].rcv.size);
         if(connection[i].rcv.link != -1) {
-            fprintf(stderr, "NCP: Completing incoming RFC.\n");
-            reply_listen(source, connection[i].snd.lsock, i);
+            LOG(LOG_NCP, LOG_INFO, "NCP: Completing incoming RFC.\n");
+            stop_timer(&connection[i].timer);
+            accept_listen(l, i);
+            reply_listen(&connection[i].client, connection[i].len,
+                         connection[i].open_id, source,
+                         connection[i].snd.lsock, i);
+            allocate(i);
         }
     } else {
         if(connection[i].snd.size != -1) {
-            fprintf(stderr, "NCP: Completing outgoing RFC.\n");
-            reply_open(source, connection[i].rcv.rsock, i);
+            LOG(LOG_NCP, LOG_INFO, "NCP: Completing outgoing RFC.\n");
+            stop_timer(&connection[i].timer);
+            connection[i].opening = 0;
+            reply_open(i, source, connection[i].rcv.rsock, i);
+            allocate(i);
         }
     }
 
@@ -437,12 +1145,12 @@ static int process_rts(uint8_t source, uint8_t *data) {
 }
 
 static int process_str(uint8_t source, uint8_t *data) {
-    int i;
+    int i, l, link;
     uint32_t lsock, rsock;
     rsock = sock(&data[0]);
     lsock = sock(&data[4]);
 
-    fprintf(stderr, "NCP: Recieved STR %u:%u from %03o.\n",
+    LOG(LOG_NCP, LOG_INFO, "NCP: Recieved STR %u:%u from %03o.\n",
                      lsock, rsock, source);
 
     if(data[8] < LINK_MIN || data[8] > LINK_MAX) {
@@ -450,37 +1158,57 @@ static int process_str(uint8_t source, uint8_t *data) {
         return 9;
     }
 
-    if(find_listen(lsock) == -1) {
-        i = find_sockets(source, lsock, rsock);
+    l = listen_find(lsock);
+    if(l == -1) {
+        i = conn_find_sockets(source, lsock, rsock);
         if(i == -1) {
-            fprintf(stderr, "NCP: Not listening to %u, no outgoing RFC, rejecting.\n", lsock);
+            LOG(LOG_NCP, LOG_INFO, "NCP: Not listening to %u, no outgoing RFC, rejecting.\n", lsock);
             ncp_err(source, ERR_CONNECT, data - 1, 10);
             return 9;
         }
-        fprintf(stderr, "NCP: Outgoing RFC socket %u.\n", lsock);
+        LOG(LOG_NCP, LOG_DEBUG, "NCP: Outgoing RFC socket %u.\n", lsock);
     } else {
-        i = find_socket(source, lsock - 1);
+        i = conn_find_sockets(source, lsock - 1, rsock - 1);
         if(i == -1) {
-            i = make_open(source, lsock, rsock, 0, 0);
-            fprintf(stderr, "NCP: Listening to %u: new connection %d.\n", lsock, i);
+            i = conn_make(source, lsock, rsock, 0, 0);
+            if(i == -1) {
+                ncp_cls(source, lsock, rsock);
+                return 9;
+            }
+            connection[i].timer = timer_start(RFC_TIMEOUT, rfc_timeout, i);
+            LOG(LOG_NCP, LOG_DEBUG, "NCP: Listening to %u: new connection %d.\n", lsock, i);
         } else {
-            connection[i].rcv.lsock = lsock;
-            connection[i].rcv.rsock = rsock;
-            fprintf(stderr, "NCP: Listening to %u: connection %d.\n", lsock, i);
+            conn_set_sockets(i, &connection[i].rcv, lsock, rsock);
+            LOG(LOG_NCP, LOG_DEBUG, "NCP: Listening to %u: connection %d.\n", lsock, i);
         }
     }
     connection[i].snd.size = data[8]; //Receive byte size.
     if(connection[i].rcv.link == -1) {
-        connection[i].rcv.link = 42; //Receive link.
+        link = new_link(source);
+        if(link == -1) {
+            LOG(LOG_NCP, LOG_INFO, "NCP: No free link to %03o, rejecting.\n", source);
+            ncp_cls(source, lsock, rsock);
+            destroy(i);
+            return 9;
+        }
+        conn_set_link(i, &connection[i].rcv, link); //Receive link.
         ncp_rts(connection[i].host, lsock, rsock, connection[i].rcv.link);
         if(connection[i].rcv.size != -1) {
-            fprintf(stderr, "NCP: Completing incoming RFC.\n");
-            reply_listen(source, connection[i].snd.lsock, i);
+            LOG(LOG_NCP, LOG_INFO, "NCP: Completing incoming RFC.\n");
+            stop_timer(&connection[i].timer);
+            accept_listen(l, i);
+            reply_listen(&connection[i].client, connection[i].len,
+                         connection[i].open_id, source,
+                         connection[i].snd.lsock, i);
+            allocate(i);
         }
     } else {
         if(connection[i].snd.link != -1) {
-            fprintf(stderr, "NCP: Completing outgoing RFC.\n");
-            reply_open(source, connection[i].rcv.rsock, i);
+            LOG(LOG_NCP, LOG_INFO, "NCP: Completing outgoing RFC.\n");
+            stop_timer(&connection[i].timer);
+            connection[i].opening = 0;
+            reply_open(i, source, connection[i].rcv.rsock, i);
+            allocate(i);
         }
     }
 
@@ -488,76 +1216,131 @@ static int process_str(uint8_t source, uint8_t *data) {
 }
 
 static int process_cls(uint8_t source, uint8_t *data) {
-    int i;
+    int i, half, confirm;
     uint32_t lsock, rsock;
     rsock = sock(&data[0]);
     lsock = sock(&data[4]);
-    i = find_sockets(source, lsock, rsock);
+    i = conn_find_sockets(source, lsock, rsock);
     if(i == -1) {
         ncp_err(source, ERR_SOCKET, data - 1, 9);
         return 8;
     }
-    if(connection[i].rcv.lsock == lsock)
-        connection[i].rcv.lsock = connection[i].rcv.rsock = 0;
+    if(connection[i].opening) {
+        // Remote refused our RFC.
+        LOG(LOG_NCP, LOG_INFO, "NCP: RFC on connection %u refused.\n", i);
+        stop_timer(&connection[i].timer);
+        reply_open(i, source, connection[i].rcv.rsock, CONN_MAX);
+        connection[i].opening = 0;
+        connection[i].len = 0;
+    }
+    // With only our side closed, a CLS for the receive link is the
+    // remote closing its side rather than confirming.
+    half = connection[i].shut && connection[i].rcv.size != -1;
+    confirm = connection[i].snd.size == -1;
+    if(connection[i].rcv.lsock == lsock) {
+        if(half)
+            confirm = 0;
+        conn_set_sockets(i, &connection[i].rcv, 0, 0);
+    }
     if(connection[i].snd.lsock == lsock)
-        connection[i].snd.lsock = connection[i].snd.rsock = 0;
+        conn_set_sockets(i, &connection[i].snd, 0, 0);
 
-    if(connection[i].snd.size == -1) {
-        // Remote confirmed closing.
-        if(connection[i].rcv.lsock == 0 && connection[i].snd.lsock == 0) {
-            fprintf(stderr, "NCP: Connection %u confirmed closed.\n", i);
-            listening[i].sock = 0;
-            destroy(i);
-            reply_close(i);
-        }
-    } else {
-        // Remote closed connection.
+    if(!confirm) {
+        // Remote closed connection, or its side of it.
         ncp_cls(connection[i].host, lsock, rsock);
-        if(connection[i].rcv.lsock == 0 && connection[i].snd.lsock == 0) {
-            fprintf(stderr, "NCP: Connection %u closed by remote.\n", i);
-            destroy(i);
-            reply_close(i);
+        if(connection[i].rcv.lsock == 0 && connection[i].snd.lsock != 0) {
+            LOG(LOG_NCP, LOG_INFO, "NCP: Connection %u half closed by remote.\n", i);
+            connection[i].rcv_eof = 1;
+            deliver(i);
         }
     }
+    if(connection[i].rcv.lsock != 0 || connection[i].snd.lsock != 0)
+        ;
+    else if(confirm && !half) {
+        LOG(LOG_NCP, LOG_INFO, "NCP: Connection %u confirmed closed.\n", i);
+        reply_close(i);
+        destroy(i);
+    } else {
+        LOG(LOG_NCP, LOG_INFO, "NCP: Connection %u closed by remote.\n", i);
+        if(connection[i].len == 0 && connection[i].timer == 0)
+            destroy(i); //No application to tell.
+        else
+            remote_closed(i);
+    }
 
     return 8;
 }
 
 static int process_all(uint8_t source, uint8_t *data) {
-    int i;
-    fprintf(stderr, "NCP: Recieved ALL from %03o, link %u.\n",
-                     source, data[0]);
-    i = find_link(source, data[0]);
-    if(i == -1)
-        ncp_err(source, ERR_SOCKET, data - 1, 10);
-    return 9;
+    int i, msgs;
+    uint32_t bits;
+    msgs = data[1] << 8 | data[2];
+    bits = sock(&data[3]);
+    LOG(LOG_NCP, LOG_DEBUG, "NCP: Recieved ALL from %03o, link %u, %d messages, %u bits.\n",
+                     source, data[0], msgs, bits);
+    i = conn_find_snd_link(source, data[0]);
+    if(i == -1) {
+        ncp_err(source, ERR_SOCKET, data - 1, 8);
+        return 7;
+    }
+    connection[i].snd.msgs += msgs;
+    if(connection[i].snd.msgs > 0xFFFF)
+        connection[i].snd.msgs = 0xFFFF;
+    if(connection[i].snd.bits + bits < bits)
+        connection[i].snd.bits = 0xFFFFFFFF;
+    else
+        connection[i].snd.bits += bits;
+    send_data(i);
+    return 7;
 }
 
 static int process_gvb(uint8_t source, uint8_t *data) {
-    int i;
-    fprintf(stderr, "NCP: Recieved GBV from %03o, link %u.",
+    int i, msgs;
+    uint32_t bits;
+    LOG(LOG_NCP, LOG_DEBUG, "NCP: Recieved GBV from %03o, link %u.\n",
                      source, data[0]);
-    i = find_link(source, data[0]);
-    if(i == -1)
+    i = conn_find_snd_link(source, data[0]);
+    if(i == -1) {
         ncp_err(source, ERR_SOCKET, data - 1, 4);
+        return 3;
+    }
+    // Fractions are in units of 1/128; 128 and above mean everything.
+    msgs = connection[i].snd.msgs;
+    bits = connection[i].snd.bits;
+    if(data[1] < 128)
+        msgs = (int64_t)msgs * data[1] / 128;
+    if(data[2] < 128)
+        bits = (uint64_t)bits * data[2] / 128;
+    connection[i].snd.msgs -= msgs;
+    connection[i].snd.bits -= bits;
+    ncp_ret(source, data[0], msgs, bits);
     return 3;
 }
 
 static int process_ret(uint8_t source, uint8_t *data) {
-    int i;
-    fprintf(stderr, "NCP: Recieved RET from %03o, link %u.",
+    int i, msgs;
+    uint32_t bits;
+    msgs = data[1] << 8 | data[2];
+    bits = sock(&data[3]);
+    LOG(LOG_NCP, LOG_DEBUG, "NCP: Recieved RET from %03o, link %u.\n",
                      source, data[0]);
-    i = find_link(source, data[0]);
-    if(i == -1)
+    i = conn_find_rcv_link(source, data[0]);
+    if(i == -1) {
         ncp_err(source, ERR_SOCKET, data - 1, 8);
+        return 7;
+    }
+    connection[i].rcv.msgs -= msgs < connection[i].rcv.msgs ?
+        msgs : connection[i].rcv.msgs;
+    connection[i].rcv.bits -= bits < connection[i].rcv.bits ?
+        bits : connection[i].rcv.bits;
     return 7;
 }
 
 static int process_inr(uint8_t source, uint8_t *data) {
     int i;
-    fprintf(stderr, "NCP: Recieved INR from %03o, link %u.",
+    LOG(LOG_NCP, LOG_INFO, "NCP: Recieved INR from %03o, link %u.\n",
                      source, data[0]);
-    i = find_link(source, data[0]);
+    i = conn_find_snd_link(source, data[0]);
     if(i == -1)
         ncp_err(source, ERR_SOCKET, data - 1, 2);
     return 1;
@@ -565,45 +1348,49 @@ static int process_inr(uint8_t source, uint8_t *data) {
 
 static int process_ins(uint8_t source, uint8_t *data) {
     int i;
-    fprintf(stderr, "NCP: Recieved INS from %03o, link %u.",
+    LOG(LOG_NCP, LOG_INFO, "NCP: Recieved INS from %03o, link %u.\n",
                      source, data[0]);
-    i = find_link(source, data[0]);
+    i = conn_find_rcv_link(source, data[0]);
     if(i == -1)
         ncp_err(source, ERR_SOCKET, data - 1, 2);
     return 1;
 }
 
 static int process_eco(uint8_t source, uint8_t *data) {
-    fprintf(stderr, "NCP: recieved ECO %03o from %03o, replying ERP %03o.\n",
+    LOG(LOG_NCP, LOG_DEBUG, "NCP: recieved ECO %03o from %03o, replying ERP %03o.\n",
                      *data, source, *data);
     ncp_erp(source, *data);
     return 1;
 }
 
-static void reply_echo(int i, uint8_t host, uint8_t data, uint8_t error) {
+// Answer an echo and forget it.
+static void reply_echo(int i, uint8_t error) {
     uint8_t reply[4];
     reply[0] = WIRE_ECHO+1;
-    reply[1] = host;
-    reply[2] = data;
+    reply[1] = echo[i].host;
+    reply[2] = echo[i].data;
     reply[3] = error;
-    if(sendto(fd, reply, sizeof reply, 0,
-                         (struct sockaddr *)&connection[i].client,
-                            connection[i].len) == -1)
-        fprintf(stderr, "NCP: sendto %s error: %s.\n",
-                         connection[i].client.sun_path, strerror(errno));
+    send_to(&echo[i].client, echo[i].len, echo[i].id, reply, sizeof reply);
+    echo_destroy(i);
+}
+
+static void eco_timeout(int i) {
+    echo[i].timer = 0;
+    LOG(LOG_NCP, LOG_INFO, "NCP: No ERP %03o from %03o.\n",
+                     echo[i].data, echo[i].host);
+    reply_echo(i, WIRE_ECHO_TIMEOUT);
 }
 
 static int process_erp(uint8_t source, uint8_t *data) {
     int i;
-    fprintf(stderr, "NCP: recieved ERP %03o from %03o.\n",
+    LOG(LOG_NCP, LOG_DEBUG, "NCP: recieved ERP %03o from %03o.\n",
                      *data, source);
-    i = find_link(source, LINK_ECHO);
+    i = echo_find(source, *data);
     if(i == -1) {
-        fprintf(stderr, "NCP: No ongoing ECO.\n");
+        LOG(LOG_NCP, LOG_INFO, "NCP: No ongoing ECO.\n");
         return 1;
     }
-    reply_echo(i, source, *data, 0x10);
-    destroy(i);
+    reply_echo(i, 0x10);
     return 1;
 }
 
@@ -620,21 +1407,19 @@ static int process_err(uint8_t source, uint8_t *data) {
     case ERR_CONNECT:     meaning = "Socket(link) not connected"; break;
     default: meaning = "Unknown"; break;
     }
-    fprintf(stderr, "NCP: recieved ERR code %03o from %03o: %s.\n",
+    LOG(LOG_NCP, LOG_ERROR, "NCP: recieved ERR code %03o from %03o: %s.\n",
                      *data, source, meaning);
-    fprintf(stderr, "NCP: error data:");
+    LOG(LOG_NCP, LOG_ERROR, "NCP: error data:");
     for(i = 1; i < 11; i++)
-        fprintf(stderr, " %03o", data[i]);
-    fprintf(stderr, "\n");
+        LOG(LOG_NCP, LOG_ERROR, " %03o", data[i]);
+    LOG(LOG_NCP, LOG_ERROR, "\n");
 
     if((data[0] == ERR_SOCKET || data[0] == ERR_CONNECT) &&
          (data[1] == NCP_RTS || data[1] == NCP_STR)) {
         rsock = sock(data + 6);
-        i = find_sockets(source, sock(data + 2), rsock);
+        i = conn_find_sockets(source, sock(data + 2), rsock);
         if(i != -1) {
-            if((rsock & 1) == 0)
-                rsock--;
-            reply_open(source, rsock, 255);
+            reply_open(i, source, connection[i].rcv.rsock, CONN_MAX);
             destroy(i);
         }
     }
@@ -644,10 +1429,11 @@ static int process_err(uint8_t source, uint8_t *data) {
 
 static int process_rst(uint8_t source, uint8_t *data) {
     int i;
-    fprintf(stderr, "NCP: recieved RST from %03o.\n", source);
-    for(i = 0; i < CONNECTIONS; i++) {
+    LOG(LOG_NCP, LOG_INFO, "NCP: recieved RST from %03o.\n", source);
+    for(i = 0; i < connections; i++) {
         if(connection[i].host != source)
             continue;
+        cancel(i);
         destroy(i);
     }
     ncp_rrp(source);
@@ -655,7 +1441,8 @@ static int process_rst(uint8_t source, uint8_t *data) {
 }
 
 static int process_rrp(uint8_t source, uint8_t *data) {
-    fprintf(stderr, "NCP: recieved RRP from %03o.\n", source);
+    LOG(LOG_NCP, LOG_INFO, "NCP: recieved RRP from %03o.\n", source);
+    resetting[source] = 0;
     return 0;
 }
 
@@ -691,35 +1478,50 @@ static void process_ncp(uint8_t source, uint8_t *data, uint16_t count) {
     }
 }
 
-static void reply_read(uint8_t connection, uint8_t *data, int n) {
-    static uint8_t reply[1000];
-    reply[0] = WIRE_READ+1;
-    reply[1] = connection;
-    memcpy(reply + 2, data, n);
-    if(sendto(fd, reply, n + 2, 0,(struct sockaddr *)&client, len) == -1)
-        fprintf(stderr, "NCP: sendto %s error: %s.\n",
-                         client.sun_path, strerror(errno));
-}
-
 static void process_regular(uint8_t *packet, int length) {
     uint8_t source = packet[1];
     uint8_t link = packet[2];
-    int i;
+    int i, n, count;
 
+    if(length < 5) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Message shorter than its header.\n");
+        return;
+    }
     if(link == 0) {
-        uint16_t count =(packet[6] << 8) | packet[7];
+        count =(packet[6] << 8) | packet[7];
+        if(count > 2 * length - 9) {
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Message shorter than byte count.\n");
+            count = 2 * length - 9;
+        }
         process_ncp(source, &packet[9], count);
     } else {
-        fprintf(stderr, "NCP: process regular from %03o link %u.\n",
+        LOG(LOG_NCP, LOG_DEBUG, "NCP: process regular from %03o link %u.\n",
                          source, link);
-        i = find_link(source, link);
+        i = conn_find_rcv_link(source, link);
         if(i == -1) {
-            fprintf(stderr, "NCP: Link not connected.\n");
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Link not connected.\n");
             return;
         }
-        length = 2 *(length - 2);
-        fprintf(stderr, "NCP: Connection %u, length %u.\n", i, length);
-        reply_read(i, packet + 4, length);
+        count = (packet[5] * ((packet[6] << 8) | packet[7]) + 7) / 8;
+        if(count > 2 * length - 9) {
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Message shorter than byte count.\n");
+            count = 2 * length - 9;
+        }
+        LOG(LOG_NCP, LOG_DEBUG, "NCP: Connection %u, length %u.\n", i, count);
+        if(connection[i].rcv.msgs == 0 || 8 * count > connection[i].rcv.bits)
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Sender exceeded allocation.\n");
+        if(connection[i].rcv.msgs > 0)
+            connection[i].rcv.msgs--;
+        connection[i].rcv.bits -= 8 * count < connection[i].rcv.bits ?
+            8 * count : connection[i].rcv.bits;
+        if(connection[i].shm != NULL)
+            n = shm_put(connection[i].shm, SHM_RX, packet + 9, count,
+                        connection[i].shm_signal);
+        else
+            n = ring_put(&connection[i].in, packet + 9, count, window);
+        if(n < count)
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Receive buffer overflow.\n");
+        deliver(i);
     }
 }
 
@@ -731,31 +1533,39 @@ static void process_leader_error(uint8_t *packet, int length) {
     case 2: reason = "Illegal type"; break;
     default: reason = "Unknown reason"; break;
     }
-    fprintf(stderr, "NCP: Error in leader: %s.\n", reason);
+    LOG(LOG_IMP, LOG_ERROR, "NCP: Error in leader: %s.\n", reason);
 }
 
 static void process_imp_down(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: IMP going down.\n");
+    LOG(LOG_IMP, LOG_INFO, "NCP: IMP going down.\n");
 }
 
 static void process_blocked(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: Blocked link.\n");
+    LOG(LOG_IMP, LOG_INFO, "NCP: Blocked link.\n");
 }
 
 static void process_imp_nop(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: NOP.\n");
+    LOG(LOG_IMP, LOG_DEBUG, "NCP: NOP.\n");
 }
 
 static void process_rfnm(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: Ready for next message to host %03o link %u.\n",
+    struct queue *q;
+    LOG(LOG_IMP, LOG_DEBUG, "NCP: Ready for next message to host %03o link %u.\n",
                      packet[1], packet[2]);
+    q = link_queue(packet[1], packet[2]);
+    if(q == NULL || !q->outstanding)
+        return;
+    queue_drop(q);
+    transmit(q);
+    drained(q, packet[1], packet[2]);
 }
 
 static void process_full(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: Link table full.\n");
+    LOG(LOG_IMP, LOG_INFO, "NCP: Link table full.\n");
 }
 
 static void process_host_dead(uint8_t *packet, int length) {
+    struct queue *q;
     int i;
     const char *reason;
     switch(packet[3] & 0x0F) {
@@ -764,20 +1574,29 @@ static void process_host_dead(uint8_t *packet, int length) {
     case 3: reason = "communication administratively prohibited"; break;
     default: reason = "dead, unknown reason"; break;
     }
-    fprintf(stderr, "NCP: Host %03o %s.\n", packet[1], reason);
+    LOG(LOG_IMP, LOG_INFO, "NCP: Host %03o %s.\n", packet[1], reason);
+    resetting[packet[1]] = 0;
 
-    i = find_link(packet[1], LINK_ECHO);
-    if(i != -1) {
-        reply_echo(i, packet[1], 0, packet[3] & 0x0F);
-        destroy(i);
+    q = link_queue(packet[1], packet[2]);
+    if(q != NULL) {
+        queue_clear(q);
+        drained(q, packet[1], packet[2]);
+    }
+    if(packet[2] == LINK_CTL)
+        commands[packet[1]].length = 0;
+
+    for(i = 0; i < echoes; i++) {
+        if(echo[i].host == packet[1])
+            reply_echo(i, packet[3] & 0x0F);
     }
 }
 
 static void process_data_error(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: Error in data.\n");
+    LOG(LOG_IMP, LOG_ERROR, "NCP: Error in data.\n");
 }
 
 static void process_incomplete(uint8_t *packet, int length) {
+    struct queue *q;
     const char *reason;
     switch(packet[3] & 0x0F) {
     case 0: reason = "Host did not accept message quickly enough"; break;
@@ -788,12 +1607,18 @@ static void process_incomplete(uint8_t *packet, int length) {
     case 5: reason = "I/O failure during reception"; break;
     default: reason = "Unknown reason"; break;
     }
-    fprintf(stderr, "NCP: Incomplete transmission from %03o: %s.\n",
+    LOG(LOG_IMP, LOG_INFO, "NCP: Incomplete transmission from %03o: %s.\n",
                      packet[1], reason);
+
+    q = link_queue(packet[1], packet[2]);
+    if(q == NULL || !q->outstanding)
+        return;
+    retry(q, packet[1], packet[2]);
 }
 
 static void process_reset(uint8_t *packet, int length) {
-    fprintf(stderr, "NCP: IMP reset.\n");
+    LOG(LOG_IMP, LOG_INFO, "NCP: IMP reset.\n");
+    retransmit_all();
 }
 
 static void(*imp_messages[])(uint8_t *packet, int length) = {
@@ -813,17 +1638,15 @@ static void(*imp_messages[])(uint8_t *packet, int length) = {
 static void process_imp(uint8_t *packet, int length) {
     int type;
 
-#if 1
-    {
+    if(LOG_ENABLED(LOG_IMP, LOG_TRACE)) {
         int i;
         for(i = 0; i < 2 * length; i+=2)
-            fprintf(stderr, " >>> %06o(%03o %03o)\n",
-                            (packet[i] << 8) | packet[i+1], packet[i], packet[i+1]);
+            log_printf(" >>> %06o(%03o %03o)\n",
+                       (packet[i] << 8) | packet[i+1], packet[i], packet[i+1]);
     }
-#endif
 
     if(length < 2) {
-        fprintf(stderr, "NCP: leader too short.\n");
+        LOG(LOG_IMP, LOG_ERROR, "NCP: leader too short.\n");
         send_leader_error(1);
         return;
     }
@@ -831,71 +1654,156 @@ static void process_imp(uint8_t *packet, int length) {
     if(type <= IMP_RESET)
         imp_messages[type](packet, length);
     else {
-        fprintf(stderr, "NCP: leader type bad.\n");
+        LOG(LOG_IMP, LOG_ERROR, "NCP: leader type bad.\n");
         send_leader_error(2);
     }
 }
 
-static void send_nops(void) {
-    send_nop();
-    sleep(1);
-    send_nop();
-    sleep(1);
+/* Starting up doesn't hold up anything else.    The host ready line goes
+   up at once, and a NOP goes out every NOP_INTERVAL until the ready line
+   of the IMP follows.    Then three NOPs tell it the host is up, and the
+   hosts given with -H are sent a RST, again every RST_INTERVAL until
+   they answer with a RRP. */
+
+static int imp_ready = 0;
+static int nop_timer;
+static int reset_timer;
+static int started;
+
+static void nop_timeout(int arg) {
+    nop_timer = 0;
     send_nop();
+    if(!imp_ready)
+        nop_timer = timer_start(NOP_INTERVAL, nop_timeout, 0);
 }
 
-static void ncp_reset(int flap) {
-    fprintf(stderr, "NCP: Reset.\n");
-    if(flap) {
-        fprintf(stderr, "NCP: Flap host ready.\n");
-        imp_host_ready(0);
-        imp_host_ready(1);
+static void reset_timeout(int arg) {
+    int i, host, n = 0;
+    reset_timer = 0;
+    for(i = 0; i < reset_count; i++) {
+        host = reset_list[i];
+        if(resetting[host] == 0)
+            continue;
+        // The first RST and RETRIES more.
+        if(resetting[host]++ > RETRIES + 1) {
+            LOG(LOG_NCP, LOG_ERROR, "NCP: No RRP from %03o.\n", host);
+            resetting[host] = 0;
+            continue;
+        }
+        ncp_rst(host);
+        n++;
     }
-
-    send_nops();
+    if(n > 0)
+        reset_timer = timer_start(RST_INTERVAL, reset_timeout, 0);
 }
 
-static int imp_ready = 0;
+static void ncp_start(void) {
+    LOG(LOG_IMP, LOG_INFO, "NCP: Starting, waiting for the IMP.\n");
+    imp_host_ready(1);
+    nop_timeout(0);
+}
 
 static void ncp_imp_ready(int flag) {
+    int i;
     if(!imp_ready && flag) {
-        fprintf(stderr, "NCP: IMP going up.\n");
-        //ncp_reset(0);
+        LOG(LOG_IMP, LOG_INFO, "NCP: IMP going up.\n");
+        timer_stop(nop_timer);
+        nop_timer = 0;
+        for(i = 0; i < 3; i++)
+            send_nop();
+        if(!started) {
+            for(i = 0; i < reset_count; i++)
+                resetting[reset_list[i]] = 1;
+            reset_timeout(0);
+            started = 1;
+        }
     } else if(imp_ready && !flag) {
-        fprintf(stderr, "NCP: IMP going down.\n");
+        LOG(LOG_IMP, LOG_INFO, "NCP: IMP going down.\n");
+        nop_timer = timer_start(NOP_INTERVAL, nop_timeout, 0);
     }
     imp_ready = flag;
 }
 
+// Parse a list of hosts to reset, like 2,3,0104.
+static int reset_option(char *list) {
+    char *end;
+    long host;
+    int i;
+    for(;;) {
+        host = strtol(list, &end, 0);
+        if(end == list || host < 0 || host > 255 || reset_count == 256)
+            return -1;
+        for(i = 0; i < reset_count && reset_list[i] != host; i++)
+            ;
+        if(i == reset_count)
+            reset_list[reset_count++] = host;
+        if(*end == 0)
+            return 0;
+        if(*end != ',')
+            return -1;
+        list = end + 1;
+    }
+}
+
+// Applications may only use their own connections.
+static int app_connection(void) {
+    int i = app[1] << 8 | app[2];
+    if(i >= connections || connection[i].host == -1) {
+        LOG(LOG_APP, LOG_ERROR, "NCP: Application connection %u not open.\n", i);
+        reply_error(-1, app[0], CONN_MAX);
+        return -1;
+    }
+    if(len != connection[i].len ||
+       memcmp(&client, &connection[i].client, len) != 0) {
+        LOG(LOG_APP, LOG_ERROR, "NCP: Connection %u not owned by %s.\n",
+                         i, client.sun_path);
+        reply_error(-1, app[0], CONN_MAX);
+        return -1;
+    }
+    return i;
+}
+
 static void app_echo(void) {
     int i;
-    fprintf(stderr, "NCP: Application echo.\n");
-    i = find_link(-1, -1);
+    LOG(LOG_APP, LOG_DEBUG, "NCP: Application echo %03o to %03o.\n",
+                     app[2], app[1]);
+    i = echo_make(app[1], app[2]);
     if(i == -1) {
-        fprintf(stderr, "NCP: Table full.\n");
+        uint8_t reply[4] = { WIRE_ECHO+1, app[1], app[2], WIRE_ECHO_FAILED };
+        LOG(LOG_APP, LOG_ERROR, "NCP: Too many echoes outstanding.\n");
+        send_reply(-1, reply, sizeof reply);
         return;
     }
-    connection[i].host = app[1];
-    connection[i].rcv.link = LINK_ECHO;
-    memcpy(&connection[i].client, &client, len);
-    connection[i].len = len;
+    memcpy(&echo[i].client, &client, len);
+    echo[i].len = len;
+    echo[i].id = app_id;
+    echo[i].timer = timer_start(limit(ECO_TIMEOUT), eco_timeout, i);
     ncp_eco(app[1], app[2]);
 }
 
 static void app_open(void) {
-    uint32_t socket;
-    int i;
+    uint32_t socket, local;
+    int i, link;
 
     socket = app[2] << 24 | app[3] << 16 | app[4] << 8 | app[5];
-    fprintf(stderr, "NCP: Application open sockets %u,%u on host %03o.\n",
+    LOG(LOG_APP, LOG_INFO, "NCP: Application open sockets %u,%u on host %03o.\n",
                      socket, socket+1, app[1]);
 
     // Initiate a connection.
-    i = make_open(app[1], 1002, socket, 1003, socket+1);
-    connection[i].rcv.link = 42; //Receive link.
+    link = new_link(app[1]);
+    local = new_sockets(app[1]);
+    i = link == -1 ? -1 : conn_make(app[1], local, socket, local+1, socket+1);
+    if(i == -1) {
+        reply_open(-1, app[1], socket, CONN_MAX);
+        return;
+    }
+    conn_set_link(i, &connection[i].rcv, link); //Receive link.
     connection[i].rcv.size = 8;    //Send byte size.
     memcpy(&connection[i].client, &client, len);
     connection[i].len = len;
+    connection[i].open_id = app_id;
+    connection[i].opening = 1;
+    connection[i].timer = timer_start(limit(RFC_TIMEOUT), open_timeout, i);
 
     // Send RFC messages.
     ncp_rts(connection[i].host, connection[i].rcv.lsock,
@@ -909,90 +1817,294 @@ static void app_listen(void) {
     int i;
 
     socket = app[1] << 24 | app[2] << 16 | app[3] << 8 | app[4];
-    fprintf(stderr, "NCP: Application listen to socket %u.\n", socket);
-    if(find_listen(socket) != -1) {
-        fprintf(stderr, "NCP: Alreay listening to %d.\n", socket);
-        reply_listen(0, socket, 0);
+    LOG(LOG_APP, LOG_INFO, "NCP: Application listen to socket %u.\n", socket);
+    if(listen_find(socket) != -1) {
+        LOG(LOG_APP, LOG_INFO, "NCP: Alreay listening to %d.\n", socket);
+        reply_listen(&client, len, app_id, 0, socket, CONN_MAX);
         return;
     }
-    i = find_listen(0);
+    i = listen_make(socket);
     if(i == -1) {
-        fprintf(stderr, "NCP: Table full.\n");
-        reply_listen(0, socket, 0);
+        reply_listen(&client, len, app_id, 0, socket, CONN_MAX);
         return;
     }
-    listening[i].sock = socket;
-    memcpy(&connection[i].client, &client, len);
-    connection[i].len = len;
+    memcpy(&listening[i].client, &client, len);
+    listening[i].len = len;
+    listening[i].id = app_id;
+    if(deadline != 0)
+        listening[i].timer = timer_start(deadline, listen_timeout, i);
 }
 
 static void app_read(void) {
-    int i;
-    i = app[1];
-    fprintf(stderr, "NCP: Application read %u octets from connection %u.\n",
-                     app[2], i);
-    ncp_all(connection[i].host, connection[i].rcv.link, 1, 8 * app[2]);
-}
-
-static void reply_write(uint8_t connection) {
-    uint8_t reply[2];
-    reply[0] = WIRE_WRITE+1;
-    reply[1] = connection;
-    if(sendto(fd, reply, sizeof reply, 0,(struct sockaddr *)&client, len) == -1)
-        fprintf(stderr, "NCP: sendto %s error: %s.\n",
-                         client.sun_path, strerror(errno));
+    int i = app_connection(), n = app[3] << 8 | app[4];
+    if(i == -1)
+        return;
+    LOG(LOG_APP, LOG_DEBUG, "NCP: Application read %u octets from connection %u.\n",
+                     n, i);
+    if(connection[i].reading || connection[i].stream != -1 ||
+       connection[i].shm != NULL) {
+        LOG(LOG_APP, LOG_ERROR, "NCP: Connection %u can't take a read.\n", i);
+        reply_error(-1, WIRE_READ, CONN_MAX);
+        return;
+    }
+    connection[i].read_id = app_id;
+    if(n == 0) {
+        reply_read(i, 0);
+        return;
+    }
+    connection[i].reading = n > WIRE_DATA ? WIRE_DATA : n;
+    deliver(i);
+    if(connection[i].reading != 0 && deadline != 0)
+        connection[i].read_timer = timer_start(deadline, read_timeout, i);
 }
 
 static void app_write(int n) {
-    int i = app[1];
-    fprintf(stderr, "NCP: Application write, %u bytes to connection %u.\n",
+    int i = app_connection();
+    if(i == -1)
+        return;
+    LOG(LOG_APP, LOG_DEBUG, "NCP: Application write, %u bytes to connection %u.\n",
                      n, i);
-    send_imp(0, IMP_REGULAR, connection[i].host, connection[i].snd.link, 0, 0,
-                        app + 2, 2 +(n + 1) / 2);
-    reply_write(i);
+    if(connection[i].writing || connection[i].stream != -1 ||
+       connection[i].shm != NULL) {
+        LOG(LOG_APP, LOG_ERROR, "NCP: Connection %u can't take a write.\n", i);
+        reply_error(-1, WIRE_WRITE, CONN_MAX);
+        return;
+    }
+    connection[i].write_id = app_id;
+    if(connection[i].eof) {
+        reply_write(i);
+        return;
+    }
+    buffer_add(&connection[i].out, app + 3, n, INT_MAX);
+    connection[i].writing = 1;
+    send_data(i);
+    if(connection[i].writing && deadline != 0)
+        connection[i].write_timer = timer_start(deadline, write_timeout, i);
 }
 
 static void app_interrupt(void) {
-    int i = app[1];
-    fprintf(stderr, "NCP: Application interrupt, connection %u.\n", i);
-    ncp_ins(connection[i].host, connection[i].snd.link);
+    int i = app_connection();
+    if(i == -1)
+        return;
+    LOG(LOG_APP, LOG_INFO, "NCP: Application interrupt, connection %u.\n", i);
+    if(!connection[i].eof)
+        ncp_ins(connection[i].host, connection[i].snd.link);
+    reply_interrupt(i);
 }
 
 static void app_close(void) {
-    int i = app[1];
-    fprintf(stderr, "NCP: Application close, connection %u.\n", i);
-    connection[i].snd.size = connection[i].rcv.size = -1;
-    ncp_cls(connection[i].host, connection[i].rcv.lsock, connection[i].rcv.rsock);
-    ncp_cls(connection[i].host, connection[i].snd.lsock, connection[i].snd.rsock);
+    int i = app_connection();
+    if(i == -1)
+        return;
+    LOG(LOG_APP, LOG_INFO, "NCP: Application close, connection %u.\n", i);
+    cancel(i);
+    stream_close(i);
+    connection[i].open_id = app_id;
+    // Send what the application put in the shared ring first.
+    if(connection[i].shm != NULL && !connection[i].eof &&
+       shm_length(connection[i].shm, SHM_TX) > 0) {
+        connection[i].draining = 1;
+        stop_timer(&connection[i].timer);
+        connection[i].timer = timer_start(limit(CLS_TIMEOUT), close_timeout, i);
+        return;
+    }
+    close_connection(i, limit(CLS_TIMEOUT));
 }
 
-static void application(void) {
-    ssize_t n;
+static void reply_pass(int i, uint8_t type, const int *pass, int passes) {
+    uint8_t reply[3];
+    reply[0] = type+1;
+    reply[1] = i >> 8;
+    reply[2] = i;
+    send_pass(&client, len, app_id, reply, sizeof reply, pass, passes);
+}
 
-    len = sizeof client;
-    n = recvfrom(fd, app, sizeof app, 0,(struct sockaddr *)&client, &len);
-    if(n == -1) {
-        fprintf(stderr, "NCP: recvfrom error.\n");
+// Hand the application a stream socket for the data of a connection.
+static void app_stream(void) {
+    int i = app_connection(), pair[2];
+    if(i == -1)
+        return;
+    LOG(LOG_APP, LOG_INFO, "NCP: Application stream, connection %u.\n", i);
+    if(connection[i].stream != -1 || connection[i].shm != NULL ||
+       connection[i].reading || connection[i].writing ||
+       connection[i].snd.size == -1 ||
+       socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        reply_error(-1, WIRE_STREAM, CONN_MAX);
         return;
     }
+    reply_pass(i, WIRE_STREAM, &pair[1], 1);
+    connection[i].stream = pair[0];
+    connection[i].stream_events = EVENT_READ;
+    event_add(pair[0], stream_event, i);
+}
 
-    fprintf(stderr, "NCP: Received application request %u from %s.\n",
-        app[0], client.sun_path);
+static void shm_event(int i) {
+    struct connection *c = &connection[i];
+    uint64_t x;
+    if(c->shm == NULL)
+        return;
+    if(read(c->shm_event, &x, sizeof x) == -1)
+        ; //Nothing signalled since last time.
+    send_data(i);
+    if(c->shm != NULL)
+        deliver(i);
+}
+
+// Make the rings and the eventfds for them, and the descriptors to pass
+// to the application: the memory and its own copies of the eventfds.
+static struct shm *make_rings(int i, int *pass) {
+#ifdef __linux__
+    struct connection *c = &connection[i];
+    struct shm *s = shm_create(window, &pass[0]);
+    if(s == NULL)
+        return NULL;
+    c->shm_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->shm_signal = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pass[1] = c->shm_signal == -1 ? -1 : dup(c->shm_signal);
+    pass[2] = c->shm_event == -1 ? -1 : dup(c->shm_event);
+    if(pass[1] != -1 && pass[2] != -1)
+        return s;
+    close(pass[0]);
+    if(pass[1] != -1)
+        close(pass[1]);
+    if(pass[2] != -1)
+        close(pass[2]);
+    if(c->shm_event != -1)
+        close(c->shm_event);
+    if(c->shm_signal != -1)
+        close(c->shm_signal);
+    c->shm_event = c->shm_signal = -1;
+    shm_unmap(s);
+#endif
+    return NULL;
+}
 
-    if(!wire_check(app[0], n)) {
-        fprintf(stderr, "NCP: bad application request.\n");
+// Share rings in memory with the application for the data of a
+// connection.    What was received before goes in the ring first.
+static void app_map(void) {
+    int i = app_connection(), n, pass[PASS_MAX];
+    uint8_t data[1024];
+    struct shm *s;
+    if(i == -1)
+        return;
+    LOG(LOG_APP, LOG_INFO, "NCP: Application map, connection %u.\n", i);
+    if(connection[i].stream != -1 || connection[i].shm != NULL ||
+       connection[i].reading || connection[i].writing ||
+       connection[i].snd.size == -1 || (s = make_rings(i, pass)) == NULL) {
+        reply_error(-1, WIRE_MAP, CONN_MAX);
         return;
     }
+    while((n = ring_get(&connection[i].in, data, sizeof data)) > 0)
+        shm_put(s, SHM_RX, data, n, connection[i].shm_signal);
+    ring_free(&connection[i].in);
+    reply_pass(i, WIRE_MAP, pass, 3);
+    connection[i].shm = s;
+    event_add(connection[i].shm_event, shm_event, i);
+    deliver(i);
+    send_data(i);
+}
+
+static void app_request(uint8_t *request, ssize_t n);
+
+// Fail a request which can't go in a batch, with its own id.
+static void reply_refused(uint8_t *request) {
+    uint8_t reply[3] = { request[0] + 1, CONN_MAX >> 8, CONN_MAX & 0xFF };
+    send_to(&client, len, request[1] << 24 | request[2] << 16 |
+            request[3] << 8 | request[4], reply, sizeof reply);
+}
+
+// Do each request in a batch, and answer those which are done at once
+// in one frame.    A batch can't pass descriptors or hold other batches.
+static void app_batch(int n) {
+    uint8_t *p = app + 1, *end = app + n;
+    int m;
+    batch_start(app_id);
+    while(end - p >= 2) {
+        m = p[0] << 8 | p[1];
+        p += 2;
+        if(m < 1 || m > end - p) {
+            LOG(LOG_APP, LOG_ERROR, "NCP: bad application batch.\n");
+            break;
+        }
+        if(p[0] == WIRE_BATCH || p[0] == WIRE_STREAM || p[0] == WIRE_MAP) {
+            LOG(LOG_APP, LOG_ERROR, "NCP: bad request in batch.\n");
+            if(m >= 1 + WIRE_ID_SIZE)
+                reply_refused(p);
+        } else
+            app_request(p, m);
+        p += m;
+    }
+    batch_flush();
+    batching = 0;
+}
+
+static void app_request(uint8_t *request, ssize_t n) {
+    LOG(LOG_APP, LOG_DEBUG, "NCP: Received application request %u from %s.\n",
+        request[0], client.sun_path);
+
+    if(!wire_check(request[0], n)) {
+        LOG(LOG_APP, LOG_ERROR, "NCP: bad application request.\n");
+        return;
+    }
+
+    // Skip the id and timeout, so the parameters follow the type.
+    app_id = request[1] << 24 | request[2] << 16 | request[3] << 8 | request[4];
+    deadline = request[5] << 24 | request[6] << 16 | request[7] << 8 | request[8];
+    app = request + WIRE_ID_SIZE + WIRE_TIMEOUT_SIZE;
+    app[0] = request[0];
+    n -= WIRE_ID_SIZE + WIRE_TIMEOUT_SIZE;
 
     switch(app[0]) {
     case WIRE_ECHO:             app_echo(); break;
     case WIRE_OPEN:             app_open(); break;
     case WIRE_LISTEN:         app_listen(); break;
     case WIRE_READ:             app_read(); break;
-    case WIRE_WRITE:      app_write(n - 2); break;
+    case WIRE_WRITE:      app_write(n - 3); break;
     case WIRE_INTERRUPT:   app_interrupt(); break;
     case WIRE_CLOSE:           app_close(); break;
-    default: fprintf(stderr, "NCP: bad application request.\n"); break;
+    case WIRE_STREAM:         app_stream(); break;
+    case WIRE_MAP:               app_map(); break;
+    case WIRE_BATCH:            app_batch(n); break;
+    default: LOG(LOG_APP, LOG_ERROR, "NCP: bad application request.\n"); break;
+    }
+}
+
+static void application(int arg) {
+    ssize_t n;
+
+    for(;;) {
+        len = sizeof client;
+        n = recvfrom(fd, request, sizeof request, 0,(struct sockaddr *)&client, &len);
+        if(n >= 0)
+            app_request(request, n);
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        else if(errno != EINTR)
+            LOG(LOG_APP, LOG_ERROR, "NCP: recvfrom error: %s.\n", strerror(errno));
+    }
+}
+
+static void stats_timeout(int arg) {
+    imp_statistics();
+    timer_start(STATS_INTERVAL, stats_timeout, 0);
+}
+
+// Frames from a capture file, a batch per pass of the event loop.
+static void replay(void) {
+    int n;
+    while(imp_replay_next() == 0 && imp_receive_message(received, &n)) {
+        if(n > 0)
+            process_imp(received, n);
+    }
+    if(imp_replay_next() == -1)
+        quit = 1;
+}
+
+static void imp(int arg) {
+    int n;
+    while(imp_receive_message(received, &n)) {
+        if(n > 0)
+            process_imp(received, n);
     }
 }
 
@@ -1001,52 +2113,120 @@ static void cleanup(void) {
 }
 
 void ncp_init(void) {
+    socklen_t size;
     char *path;
-    int i;
+    int n;
 
     fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    // Some systems limit datagrams to the size of the send buffer.
+    size = sizeof n;
+    if(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &n, &size) == 0 && n < 2 * WIRE_SIZE) {
+        n = 2 * WIRE_SIZE;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &n, sizeof n);
+    }
     memset(&server, 0, sizeof server);
     server.sun_family = AF_UNIX;
     path = getenv("NCP");
     strncpy(server.sun_path, path, sizeof server.sun_path - 1);
     if(bind(fd,(struct sockaddr *)&server, sizeof server) == -1) {
-        fprintf(stderr, "NCP: bind error: %s.\n", strerror(errno));
-        fprintf(stderr, "Is $NCP set to the path to a domain socket? If so, run 'rm $NCP' before retrying.\n");
+        LOG(LOG_APP, LOG_ERROR, "NCP: bind error: %s.\n", strerror(errno));
+        LOG(LOG_APP, LOG_ERROR, "Is $NCP set to the path to a domain socket? If so, run 'rm $NCP' before retrying.\n");
         exit(1);
     }
     atexit(cleanup);
 
-    for(i = 0; i < CONNECTIONS; i ++) {
-        destroy(i);
-        listening[i].sock = 0;
-    }
+    conn_init();
+}
+
+// Leave through exit, so the log is written out and the socket removed.
+static void terminate(int sig) {
+    quit = 1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-b] [-c capture] [-f faults] [-H hosts] "
+            "[-l levels] [-w window] host port port\n"
+            "       %s [-c capture] [-f faults] [-l levels] [-w window] "
+            "-r|-R replay\n", argv0, argv0);
+    exit(1);
 }
 
 int main(int argc, char **argv) {
-    imp_init(argc, argv);
+    int c;
+
+    char *capture = NULL;
+
+    while((c = getopt(argc, argv, "bc:f:H:l:r:R:w:")) != -1) {
+        switch(c) {
+        case 'b':
+            // Back to back with another NCP, no IMP in between.
+            rfnm_wait = 0;
+            break;
+        case 'c':
+            capture = optarg;
+            break;
+        case 'f':
+            if(imp_faults(optarg) == -1)
+                usage(argv[0]);
+            break;
+        case 'H':
+            if(reset_option(optarg) == -1)
+                usage(argv[0]);
+            break;
+        case 'l':
+            if(log_option(optarg) == -1)
+                usage(argv[0]);
+            break;
+        case 'r':
+            replay_realtime = 1;
+            // Fall through.
+        case 'R':
+            replay_file = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            if(window < 1 || window > 0x1FFFFFFF)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    atexit(log_drain);
+    if(replay_file != NULL) {
+        // Replies from the NCP go nowhere, so don't wait for RFNMs.
+        if(optind != argc)
+            usage(argv[0]);
+        rfnm_wait = 0;
+        imp_replay(replay_file, replay_realtime);
+    } else if(argc - optind == 3)
+        imp_init(argc - optind + 1, argv + optind - 1);
+    else
+        usage(argv[0]);
+    if(capture != NULL)
+        imp_capture(capture);
+    event_init();
     ncp_init();
     imp_imp_ready = ncp_imp_ready;
-    imp_host_ready(1);
-    ncp_reset(0);
-    for(;;) {
-        int n;
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        imp_fd_set(&rfds);
-        n = select(33, &rfds, NULL, NULL, NULL);
-        if(n == -1)
-            fprintf(stderr, "NCP: select error.\n");
-        else if(n > 0) {
-            if(imp_fd_isset(&rfds)) {
-                memset(packet, 0, sizeof packet);
-                imp_receive_message(packet, &n);
-                if(n > 0)
-                    process_imp(packet, n);
-            }
-            if(FD_ISSET(fd, &rfds)) {
-                application();
-            }
-        }
+    ncp_start();
+    if(replay_file == NULL)
+        event_add(imp_fd(), imp, 0);
+    event_add(fd, application, 0);
+    timer_start(STATS_INTERVAL, stats_timeout, 0);
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+    signal(SIGPIPE, SIG_IGN); //Applications may close their streams.
+    while(!quit) {
+        flush_all_commands();
+        imp_flush();
+        log_flush();
+        event_poll(imp_next());
+        if(replay_file != NULL)
+            replay();
+        else if(imp_next() == 0)
+            imp(0); //Frames held back by fault injection.
     }
+    imp_statistics();
+    return 0;
 }
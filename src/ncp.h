@@ -1,10 +1,81 @@
 /* Library for applications. */
 
 extern int ncp_init(const char *path);
+/* Requests after this give up after ms milliseconds and return
+   NCP_TIMEOUT, unless they set their own timeout.    0 restores the
+   default of a minute and -1 waits for ever, even for an NCP which
+   doesn't answer. */
+extern void ncp_timeout(int ms);
+#define NCP_TIMEOUT -34
 extern int ncp_echo(int host, int data, int *reply);
+/* Echo to many hosts at once.    done is called with the index of each
+   probe and what ncp_echo would return for it, in the order the replies
+   come; it must not call the library. */
+extern int ncp_echo_many(int n, const int *host, const int *data,
+                         void (*done)(int i, int result));
 extern int ncp_open(int host, unsigned socket, int *connection);
 extern int ncp_listen(unsigned socket, int *host, int *connection);
 extern int ncp_read(int connection, void *data, int *length);
 extern int ncp_write(int connection, void *data, int length);
 extern int ncp_interrupt(int connection);
 extern int ncp_close(int connection);
+/* Get a stream socket for the data of an open connection, to use with
+   read, write and poll instead of ncp_read and ncp_write.    Shutting it
+   down for writing leaves the connection open for reading, and the
+   remote closing it shows as the end of file.    Closing the socket
+   closes the connection once what was written is sent. */
+extern int ncp_stream(int connection, int *fd);
+/* Share rings in memory with the NCP for the data of an open connection,
+   so it's copied in and out once and no request crosses the socket.
+   ncp_send and ncp_recv take what fits or is there and return how much,
+   or -1 with errno EAGAIN if nothing; fd becomes readable once they may
+   do more.    ncp_recv returns 0 once the remote has closed its side and
+   everything is taken, and ncp_send with length 0 closes ours.
+   ncp_close sends what is still in the ring before closing. */
+extern int ncp_map(int connection, int *fd);
+extern int ncp_send(int connection, const void *data, int length);
+extern int ncp_recv(int connection, void *data, int length);
+
+/* Requests can also be made without waiting for them.    Fill in an
+   ncp_op and pass it to ncp_submit, which returns at once.    The op must
+   stay put until ncp_reap hands it back, with result set to what the
+   blocking call would have returned.    Any number of requests may be
+   outstanding, but at most one read and one write on each connection,
+   and they finish in any order.    ncp_fd becomes readable when replies
+   come in; call ncp_reap with ms 0 until it returns 0 before waiting for
+   it, since a blocking call may already have taken them. */
+#define NCP_OP_ECHO      1
+#define NCP_OP_OPEN      2
+#define NCP_OP_LISTEN    3
+#define NCP_OP_READ      4
+#define NCP_OP_WRITE     5
+#define NCP_OP_INTERRUPT 6
+#define NCP_OP_CLOSE     7
+#define NCP_OP_STREAM    8
+#define NCP_OP_MAP       9
+
+struct ncp_op {
+    int type;
+    int host;            //Echo and open, set by listen.
+    int data;            //Echo: sent, then what came back.
+    unsigned socket;     //Open and listen.
+    int connection;      //Set by open and listen, given to the rest.
+    void *buffer;        //Read into or written from.
+    int length;          //Of the buffer, then of what was read.
+    int fd;              //Set by stream and map.
+    int timeout;         //Milliseconds, 0 as ncp_timeout, -1 for ever.
+    int result;
+    void *user;          //For the application.
+    struct ncp_op *next; //For the library.
+};
+
+extern int ncp_submit(struct ncp_op *op);
+/* Submit n requests at once, in as few datagrams as they fit in, and
+   return how many were submitted; fewer than n only on error.    The NCP
+   answers those it can do right away in one datagram too.    Streams and
+   maps can't be batched. */
+extern int ncp_submit_batch(struct ncp_op **op, int n);
+/* Wait up to ms milliseconds, or for ever if ms is -1, for requests to
+   finish, put up to n of them in op and return how many. */
+extern int ncp_reap(struct ncp_op **op, int n, int ms);
+extern int ncp_fd(void);
@@ -0,0 +1,405 @@
+/* Measure NCP throughput and connection setup.    The server side
+     listens on a range of sockets, one worker process per socket, and
+     reads whatever comes.    The client side runs parallel streams, each
+     a process with its own connection, which either write for a given
+     time or open and close connections over and over.
+
+     The streams use the blocking calls, hence the processes.    In
+     churn mode each stream alternates between two sockets, so that the
+     server has time to listen again before the next open arrives.    A
+     server started with -P n serves n sockets.    With -m the data goes
+     through rings shared with the NCP instead, on both sides. */
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "ncp.h"
+
+#define SAMPLES (1 << 20) //Latencies kept per stream.
+#define READ_SIZE 8192    //Most a read asks for.
+#define ROTATE 2          //Sockets each stream goes through in churn mode.
+
+static int server;
+static int churn;
+static int mapped;
+static int streams = 1;
+static int write_size = 1000;
+static double duration = 10;
+static unsigned base = 1000;
+static int host;
+
+// What a stream reports back to the parent, followed by its samples.
+struct result {
+    uint64_t octets, operations, refused, failed;
+    uint64_t elapsed;      //Nanoseconds.
+    int samples, samples2; //Open and close latencies in churn mode.
+};
+
+static uint64_t now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s -s [-m] [-P workers] [-p socket]\n"
+            "       %s [-C] [-m] [-P streams] [-l size] [-t seconds] [-p socket] host\n",
+            argv0, argv0);
+    exit(1);
+}
+
+static void args(int argc, char **argv) {
+    int c;
+
+    while((c = getopt(argc, argv, "Cl:mp:P:st:")) != -1) {
+        switch(c) {
+        case 'C':
+            churn = 1;
+            break;
+        case 'm':
+            mapped = 1;
+            break;
+        case 'l':
+            write_size = atoi(optarg);
+            break;
+        case 'p':
+            base = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            streams = atoi(optarg);
+            break;
+        case 's':
+            server = 1;
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(write_size < 1 || streams < 1 || duration <= 0)
+        usage(argv[0]);
+    if(server && optind == argc)
+        return;
+    if(server || optind != argc - 1)
+        usage(argv[0]);
+    host = strtol(argv[optind], NULL, 0);
+}
+
+static void init(void) {
+    if(ncp_init(NULL) == -1) {
+        fprintf(stderr, "NCP initializtion error: %s.\n", strerror(errno));
+        if(errno == ECONNREFUSED)
+            fprintf(stderr, "Is the NCP server started?\n");
+        exit(1);
+    }
+}
+
+// Wait for the rings of a mapped connection to move.
+static void wait_map(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    poll(&p, 1, -1);
+}
+
+// Read from a connection until the other end closes it.
+static uint64_t drain(int connection) {
+    static char buffer[READ_SIZE], ring_buffer[65536];
+    uint64_t octets = 0;
+    int fd, size, r;
+
+    if(mapped) {
+        if(ncp_map(connection, &fd) == -1) {
+            fprintf(stderr, "NCP map error.\n");
+            return 0;
+        }
+        while((size = ncp_recv(connection, ring_buffer, sizeof ring_buffer)) != 0) {
+            if(size == -1)
+                wait_map(fd);
+            else
+                octets += size;
+        }
+        return octets;
+    }
+    do {
+        size = sizeof buffer;
+        r = ncp_read(connection, buffer, &size);
+        if(r == NCP_TIMEOUT)
+            continue; //Nothing yet.
+        if(r != 0) {
+            fprintf(stderr, "NCP read error.\n");
+            break;
+        }
+        octets += size;
+    } while(size > 0);
+    return octets;
+}
+
+// Serve connections to one socket, one after another.
+static void worker(unsigned socket) {
+    uint64_t octets, start;
+    int connection, from, r;
+    double seconds;
+
+    init();
+    for(;;) {
+        r = ncp_listen(socket, &from, &connection);
+        if(r == NCP_TIMEOUT)
+            continue; //Nobody yet.
+        if(r != 0) {
+            fprintf(stderr, "NCP listen error.\n");
+            exit(1);
+        }
+        start = now();
+        octets = drain(connection);
+        ncp_close(connection);
+        if(octets == 0)
+            continue;
+        seconds = (now() - start) / 1e9;
+        printf("Socket %u: %llu octets from host %03o in %.3f s, %.0f octets/s.\n",
+               socket, (unsigned long long)octets, from, seconds,
+               octets / seconds);
+        fflush(stdout);
+    }
+}
+
+static void run_server(void) {
+    int i;
+
+    printf("Listening on sockets %u to %u.\n", base, base + 2 * (streams - 1));
+    fflush(stdout);
+    for(i = 0; i < streams; i++) {
+        if(fork() == 0) {
+            worker(base + 2 * i);
+            exit(0);
+        }
+    }
+    while(wait(NULL) > 0)
+        ;
+}
+
+// Put all of a write in the rings, waiting for room.
+static int send_all(int connection, int fd, char *data, int n) {
+    int m;
+    while(n > 0) {
+        m = ncp_send(connection, data, n);
+        if(m == -1 && errno != EAGAIN)
+            return -1;
+        if(m == -1) {
+            wait_map(fd);
+            continue;
+        }
+        data += m;
+        n -= m;
+    }
+    return 0;
+}
+
+// Write for the duration on one connection.
+static void stream(int k, struct result *r, uint32_t *sample) {
+    uint64_t start, t, end;
+    char *buffer = malloc(write_size);
+    int connection, fd = -1, n;
+
+    if(buffer == NULL) {
+        r->failed++;
+        return;
+    }
+    memset(buffer, 'x', write_size);
+    if(ncp_open(host, base + 2 * k, &connection) != 0 ||
+       (mapped && ncp_map(connection, &fd) != 0)) {
+        r->failed++;
+        return;
+    }
+    start = now();
+    end = start + duration * 1e9;
+    do {
+        t = now();
+        if(mapped)
+            n = send_all(connection, fd, buffer, write_size);
+        else
+            n = ncp_write(connection, buffer, write_size);
+        if(n == -1) {
+            r->failed++;
+            break;
+        }
+        if(r->samples < SAMPLES)
+            sample[r->samples++] = (now() - t) / 1000;
+        r->octets += write_size;
+        r->operations++;
+    } while(now() < end);
+    ncp_close(connection);
+    r->elapsed = now() - start;
+}
+
+// Open and close connections for the duration.
+static void open_close(int k, struct result *r, uint32_t *sample) {
+    uint64_t start, t, end;
+    int connection, c, i = 0;
+
+    start = now();
+    end = start + duration * 1e9;
+    do {
+        t = now();
+        c = ncp_open(host, base + 2 * (ROTATE * k + i), &connection);
+        i = (i + 1) % ROTATE;
+        if(c == -2) {
+            r->refused++;
+            continue;
+        } else if(c != 0) {
+            r->failed++;
+            continue;
+        }
+        if(r->samples < SAMPLES)
+            sample[r->samples++] = (now() - t) / 1000;
+        t = now();
+        if(ncp_close(connection) == -1)
+            r->failed++;
+        if(r->samples2 < SAMPLES)
+            sample[SAMPLES + r->samples2++] = (now() - t) / 1000;
+        r->operations++;
+    } while(now() < end);
+    r->elapsed = now() - start;
+}
+
+static int compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void percentiles(const char *what, uint32_t *sample, int n) {
+    static const double p[] = { 50, 90, 99, 99.9 };
+    int i;
+
+    if(n == 0)
+        return;
+    qsort(sample, n, sizeof *sample, compare);
+    printf("%s latency, ms:", what);
+    for(i = 0; i < 4; i++)
+        printf(" p%g %.3f,", p[i], sample[(int)(p[i] / 100 * (n - 1))] / 1e3);
+    printf(" max %.3f.\n", sample[n - 1] / 1e3);
+}
+
+static int read_all(int fd, void *data, size_t n) {
+    char *p = data;
+    ssize_t m;
+    while(n > 0) {
+        m = read(fd, p, n);
+        if(m <= 0)
+            return -1;
+        p += m;
+        n -= m;
+    }
+    return 0;
+}
+
+static void write_all(int fd, const void *data, size_t n) {
+    const char *p = data;
+    ssize_t m;
+    while(n > 0) {
+        m = write(fd, p, n);
+        if(m <= 0)
+            exit(1);
+        p += m;
+        n -= m;
+    }
+}
+
+static void run_client(void) {
+    uint32_t *sample, *all, *all2;
+    struct result total, r;
+    int i, n = 0, n2 = 0;
+    int (*pipes)[2];
+    double seconds;
+
+    pipes = malloc(streams * sizeof *pipes);
+    sample = malloc(2 * SAMPLES * sizeof *sample);
+    if(pipes == NULL || sample == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < streams; i++) {
+        if(pipe(pipes[i]) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        if(fork() == 0) {
+            memset(&r, 0, sizeof r);
+            init();
+            if(churn)
+                open_close(i, &r, sample);
+            else
+                stream(i, &r, sample);
+            write_all(pipes[i][1], &r, sizeof r);
+            write_all(pipes[i][1], sample, r.samples * sizeof *sample);
+            write_all(pipes[i][1], sample + SAMPLES, r.samples2 * sizeof *sample);
+            exit(0);
+        }
+        close(pipes[i][1]);
+    }
+
+    memset(&total, 0, sizeof total);
+    all = malloc(streams * sizeof *all * (size_t)SAMPLES);
+    all2 = malloc(streams * sizeof *all2 * (size_t)SAMPLES);
+    if(all == NULL || all2 == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < streams; i++) {
+        if(read_all(pipes[i][0], &r, sizeof r) == -1
+           || read_all(pipes[i][0], all + n, r.samples * sizeof *all) == -1
+           || read_all(pipes[i][0], all2 + n2, r.samples2 * sizeof *all) == -1) {
+            fprintf(stderr, "Stream %d died.\n", i);
+            continue;
+        }
+        total.octets += r.octets;
+        total.operations += r.operations;
+        total.refused += r.refused;
+        total.failed += r.failed;
+        if(r.elapsed > total.elapsed)
+            total.elapsed = r.elapsed;
+        n += r.samples;
+        n2 += r.samples2;
+    }
+    while(wait(NULL) > 0)
+        ;
+
+    seconds = total.elapsed / 1e9;
+    if(seconds == 0)
+        seconds = 1e-9;
+    if(churn) {
+        printf("%d streams opening and closing connections to host %03o "
+               "for %.3f s.\n", streams, host, seconds);
+        printf("%llu connections, %.1f setups/s, %llu refused, %llu failed.\n",
+               (unsigned long long)total.operations, total.operations / seconds,
+               (unsigned long long)total.refused,
+               (unsigned long long)total.failed);
+        percentiles("Open", all, n);
+        percentiles("Close", all2, n2);
+    } else {
+        printf("%d streams writing %d octets at a time to host %03o "
+               "for %.3f s.\n", streams, write_size, host, seconds);
+        printf("%llu octets, %.0f octets/s, %.1f writes/s, %llu failed.\n",
+               (unsigned long long)total.octets, total.octets / seconds,
+               total.operations / seconds, (unsigned long long)total.failed);
+        percentiles("Write", all, n);
+    }
+}
+
+int main(int argc, char **argv) {
+    args(argc, argv);
+    if(server)
+        run_server();
+    else
+        run_client();
+    return 0;
+}
@@ -1,20 +1,35 @@
 #include <time.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "ncp.h"
 
+/* Round trip times go in a histogram with a linear range of SUB
+   nanosecond buckets, followed by SUB buckets for every further power
+   of two.    That keeps every value to within 1% over any range. */
+#define SUB_BITS 7
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS) * SUB)
+
 static int host;
 static int seq = 1;
 static int count = -1;
-static struct timespec interval;
+static int flood;
+static int parallel = 1;
+static int wait_ms;
+static uint64_t interval = 1000000000; //Nanoseconds between echoes.
+
+static uint64_t histogram[BUCKETS];
+static uint64_t sent, received, lost;
+static uint64_t min = UINT64_MAX, max, total;
 
 static void usage(const char *argv0) {
-    fprintf(stderr, "Usage: %s [-c<count>] host [seq]\n", argv0);
+    fprintf(stderr, "Usage: %s [-f] [-c<count>] [-i<interval>] [-P<parallel>] [-W<timeout>]"
+            " host [seq]\n", argv0);
     exit(1);
 }
 
@@ -22,18 +37,25 @@ static void args(int argc, char **argv) {
     double x;
     int c;
 
-    interval.tv_sec = 1;
-    interval.tv_nsec = 0;
-
-    while((c = getopt(argc, argv, "c:i:")) != -1) {
+    while((c = getopt(argc, argv, "c:fi:P:W:")) != -1) {
         switch(c) {
         case 'c':
             count = atoi(optarg);
             break;
+        case 'f':
+            flood = 1;
+            break;
         case 'i':
             x = atof(optarg);
-            interval.tv_sec =(int)x;
-            interval.tv_nsec = 1e9 *(x - interval.tv_sec);
+            interval = 1e9 * x;
+            break;
+        case 'W':
+            wait_ms = 1000 * atof(optarg);
+            break;
+        case 'P':
+            parallel = atoi(optarg);
+            if(parallel < 1 || parallel > 256)
+                usage(argv[0]);
             break;
         default:
             usage(argv[0]);
@@ -50,17 +72,163 @@ static void args(int argc, char **argv) {
         seq = atoi(argv[optind]);
 }
 
-static int difference(struct timeval *start, struct timeval *stop) {
-    int ms;
-    ms = 1000 *(stop->tv_sec - start->tv_sec);
-    ms +=(stop->tv_usec - start->tv_usec + 500) / 1000;
-    return ms;
+static uint64_t nanoseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
-int main(int argc, char **argv) {
-    struct timeval start, stop;
-    int ms, reply;
+static int bucket(uint64_t ns) {
+    int shift;
+    if(ns < SUB)
+        return ns;
+    shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+    return (shift + 1) * SUB + ((ns >> shift) - SUB);
+}
+
+// The middle of the values that go in a bucket.
+static uint64_t value(int i) {
+    int shift;
+    if(i < SUB)
+        return i;
+    shift = i / SUB - 1;
+    return ((uint64_t)(i % SUB + SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+static void record(uint64_t ns) {
+    histogram[bucket(ns)]++;
+    received++;
+    total += ns;
+    if(ns < min)
+        min = ns;
+    if(ns > max)
+        max = ns;
+}
+
+// Nearest rank: the smallest value with at least p percent of them at or
+// below it.    p is taken in tenths so the rank is rounded up exactly.
+static uint64_t percentile(double p) {
+    uint64_t n = 0, tenths = p * 10 + 0.5;
+    uint64_t rank = (tenths * received + 999) / 1000;
+    int i;
+    if(rank < 1)
+        rank = 1;
+    for(i = 0; i < BUCKETS; i++) {
+        n += histogram[i];
+        if(n >= rank)
+            break;
+    }
+    // Keep to what was actually seen.
+    if(value(i) < min)
+        return min;
+    if(value(i) > max)
+        return max;
+    return value(i);
+}
+
+// Also run when the library exits on a signal.
+static void statistics(void) {
+    printf("--- host %03o ping statistics ---\n", host);
+    printf("%llu sent, %llu received, %llu lost.\n",
+           (unsigned long long)sent, (unsigned long long)received,
+           (unsigned long long)lost);
+    if(received == 0)
+        return;
+    printf("Round trip ms: min %.3f, mean %.3f, p50 %.3f, p90 %.3f, "
+           "p99 %.3f, p99.9 %.3f, max %.3f\n",
+           min / 1e6, total / 1e6 / received, percentile(50) / 1e6,
+           percentile(90) / 1e6, percentile(99) / 1e6,
+           percentile(99.9) / 1e6, max / 1e6);
+}
+
+// Echoes in flight, each timed from when it was submitted.    A slot with
+// type 0 is free.
+static struct ncp_op echo[256];
+static uint64_t start[256];
+
+static void done(int i, int result) {
+    uint64_t ns = nanoseconds() - start[i];
+    switch(result) {
+    case 0:
+        record(ns);
+        if(!flood)
+            printf("Reply from host %03o: seq=%u time=%.3fms\n",
+                   host, echo[i].data, ns / 1e6);
+        break;
+    case NCP_TIMEOUT:
+        lost++;
+        if(!flood)
+            printf("No reply from host %03o: seq=%u\n", host, echo[i].data);
+        break;
+    case -2:
+        fprintf(stderr, "IMP cannot be reached.\n");
+        exit(1);
+        break;
+    case -3:
+        fprintf(stderr, "Host is not up.\n");
+        exit(1);
+        break;
+    case -5:
+        fprintf(stderr, "Communication administratively prohibited.\n");
+        exit(1);
+        break;
+    default:
+        fprintf(stderr, "NCP echo error.\n");
+        exit(1);
+    }
+}
+
+// Send an echo in a free slot.
+static void submit(void) {
+    int i;
+    for(i = 0; echo[i].type != 0; i++)
+        ;
+    echo[i].type = NCP_OP_ECHO;
+    echo[i].host = host;
+    echo[i].data = seq++ & 0377;
+    start[i] = nanoseconds();
+    if(ncp_submit(&echo[i]) == -1) {
+        fprintf(stderr, "NCP echo error.\n");
+        exit(1);
+    }
+    sent++;
+    if(count > 0)
+        count--;
+}
+
+// Keep up to parallel echoes in flight, sending a new one as soon as
+// one is answered, or once the interval has passed since the last one.
+static void run(void) {
+    struct ncp_op *finished[256];
+    uint64_t next = nanoseconds(), t;
+    int i, k, flight = 0, ms;
+
+    while(count != 0 || flight > 0) {
+        t = nanoseconds();
+        while(count != 0 && flight < parallel && (flood || t >= next)) {
+            submit();
+            flight++;
+            next = t + interval;
+        }
+        ms = -1;
+        if(count != 0 && flight < parallel && !flood)
+            ms = (next - t + 999999) / 1000000;
+        k = ncp_reap(finished, 256, ms);
+        if(k == -1) {
+            fprintf(stderr, "NCP echo error.\n");
+            exit(1);
+        }
+        for(i = 0; i < k; i++) {
+            done(finished[i] - echo, finished[i]->result);
+            finished[i]->type = 0; //Free for the next echo.
+            flight--;
+        }
+        if(k > 0 && !flood)
+            fflush(stdout);
+    }
+}
 
+int main(int argc, char **argv) {
     args(argc, argv);
 
     if(ncp_init(NULL) == -1) {
@@ -70,35 +238,11 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    ncp_timeout(wait_ms);
     printf("NCP PING host %03o\n", host);
+    fflush(stdout);
+    atexit(statistics);
 
-    while(count != 0) {
-        gettimeofday(&start, NULL);
-        switch(ncp_echo(host, seq, &reply)) {
-        case 0:
-            break;
-        case -2:
-            fprintf(stderr, "IMP cannot be reached.\n");
-            exit(1);
-            break;
-        case -3:
-            fprintf(stderr, "Host is not up.\n");
-            exit(1);
-            break;
-        case -5:
-            fprintf(stderr, "Communication administratively prohibited.\n");
-            exit(1);
-            break;
-        default:
-            fprintf(stderr, "NCP echo error.\n");
-            exit(1);
-        }
-        gettimeofday(&stop, NULL);
-        ms = difference(&start, &stop);
-        printf("Reply from host %03o: seq=%u time=%ums\n", host, reply, ms);
-        count--;
-        if(count != 0)
-            nanosleep(&interval, NULL);
-        seq++;
-    }
+    run();
+    return 0;
 }
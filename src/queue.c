@@ -0,0 +1,172 @@
+/* Queues of IMP messages and buffers of data waiting to be transmitted
+     or read. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "queue.h"
+#include "timer.h"
+
+// Data is a complete buffer for imp_send_message, header included.
+void queue_put(struct queue *q, uint8_t *data, int words) {
+    struct message *m = malloc(sizeof *m + 12 + 2 * words);
+    if(m == NULL) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+        exit(1);
+    }
+    m->next = NULL;
+    m->words = words;
+    memcpy(m->data, data, 12 + 2 * words);
+    if(q->tail == NULL)
+        q->head = m;
+    else
+        q->tail->next = m;
+    q->tail = m;
+}
+
+void queue_drop(struct queue *q) {
+    struct message *m = q->head;
+    if(m == NULL)
+        return;
+    q->head = m->next;
+    if(q->head == NULL)
+        q->tail = NULL;
+    q->outstanding = q->retries = 0;
+    timer_stop(q->timer);
+    q->timer = 0;
+    free(m);
+}
+
+void queue_clear(struct queue *q) {
+    while(q->head != NULL)
+        queue_drop(q);
+}
+
+// Append at most n octets without growing past limit.    Returns the
+// number of octets added.
+int buffer_add(struct buffer *b, const uint8_t *data, int n, int limit) {
+    if(n > limit - b->length)
+        n = limit - b->length;
+    if(n <= 0)
+        return 0;
+    if(b->length + n > b->size) {
+        int size = b->size == 0 ? 256 : b->size;
+        uint8_t *p;
+        while(size < b->length + n)
+            size *= 2;
+        if(size > limit)
+            size = limit;
+        p = realloc(b->data, size);
+        if(p == NULL) {
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+            exit(1);
+        }
+        b->data = p;
+        b->size = size;
+    }
+    memcpy(b->data + b->length, data, n);
+    b->length += n;
+    return n;
+}
+
+void buffer_remove(struct buffer *b, int n) {
+    if(n >= b->length) {
+        b->length = 0;
+        return;
+    }
+    memmove(b->data, b->data + n, b->length - n);
+    b->length -= n;
+}
+
+// Read up to the limit from a descriptor into the buffer.    Returns
+// what read does.
+int buffer_read(struct buffer *b, int fd, int limit) {
+    ssize_t n;
+    if(limit - b->length <= 0)
+        return 0;
+    if(b->size < limit) {
+        uint8_t *p = realloc(b->data, limit);
+        if(p == NULL) {
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+            exit(1);
+        }
+        b->data = p;
+        b->size = limit;
+    }
+    n = read(fd, b->data + b->length, limit - b->length);
+    if(n > 0)
+        b->length += n;
+    return n;
+}
+
+void buffer_free(struct buffer *b) {
+    free(b->data);
+    b->data = NULL;
+    b->length = b->size = 0;
+}
+
+// The ring's storage is allocated with the given size on first use.
+// Returns the number of octets that fit.
+int ring_put(struct ring *r, const uint8_t *data, int n, int size) {
+    int tail, m;
+    if(r->data == NULL) {
+        r->data = malloc(size);
+        if(r->data == NULL) {
+            LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+            exit(1);
+        }
+        r->size = size;
+        r->head = r->length = 0;
+    }
+    if(n > r->size - r->length)
+        n = r->size - r->length;
+    tail = (r->head + r->length) % r->size;
+    m = r->size - tail < n ? r->size - tail : n;
+    memcpy(r->data + tail, data, m);
+    memcpy(r->data, data + m, n - m);
+    r->length += n;
+    return n;
+}
+
+int ring_get(struct ring *r, uint8_t *data, int n) {
+    int m;
+    if(n > r->length)
+        n = r->length;
+    if(n == 0)
+        return 0;
+    m = r->size - r->head < n ? r->size - r->head : n;
+    memcpy(data, r->data + r->head, m);
+    memcpy(data + m, r->data, n - m);
+    r->head = (r->head + n) % r->size;
+    r->length -= n;
+    return n;
+}
+
+// Write as much of the ring to a descriptor as it takes.    Returns
+// what writev does.
+int ring_write(struct ring *r, int fd) {
+    struct iovec v[2];
+    ssize_t n;
+    int m;
+    if(r->length == 0)
+        return 0;
+    m = r->size - r->head < r->length ? r->size - r->head : r->length;
+    v[0].iov_base = r->data + r->head;
+    v[0].iov_len = m;
+    v[1].iov_base = r->data;
+    v[1].iov_len = r->length - m;
+    n = writev(fd, v, v[1].iov_len > 0 ? 2 : 1);
+    if(n > 0) {
+        r->head = (r->head + n) % r->size;
+        r->length -= n;
+    }
+    return n;
+}
+
+void ring_free(struct ring *r) {
+    free(r->data);
+    memset(r, 0, sizeof *r);
+}
@@ -0,0 +1,41 @@
+/* Queues of IMP messages and buffers of data waiting to be transmitted
+     or read. */
+
+#include <stdint.h>
+
+struct message {
+    struct message *next;
+    int words;
+    uint8_t data[];
+};
+
+struct queue {
+    struct message *head, *tail;
+    int outstanding; //Head is sent, waiting for RFNM.
+    int retries;
+    int timer;       //RFNM timeout.
+};
+
+extern void queue_put(struct queue *q, uint8_t *data, int words);
+extern void queue_drop(struct queue *q);
+extern void queue_clear(struct queue *q);
+
+struct buffer {
+    uint8_t *data;
+    int length, size;
+};
+
+extern int buffer_add(struct buffer *b, const uint8_t *data, int n, int limit);
+extern void buffer_remove(struct buffer *b, int n);
+extern int buffer_read(struct buffer *b, int fd, int limit);
+extern void buffer_free(struct buffer *b);
+
+struct ring {
+    uint8_t *data;
+    int head, length, size;
+};
+
+extern int ring_put(struct ring *r, const uint8_t *data, int n, int size);
+extern int ring_get(struct ring *r, uint8_t *data, int n);
+extern int ring_write(struct ring *r, int fd);
+extern void ring_free(struct ring *r);
@@ -0,0 +1,164 @@
+/* Rings in memory shared between an application and the NCP. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm.h"
+
+// Indices are only ever moved by one side, but each side reads the
+// other's.    Moving an index and then looking at the flag, against
+// setting the flag and then looking at the index, takes sequential
+// consistency so that one of the two sides sees the other.
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, y) __atomic_store_n(&(x), (y), __ATOMIC_SEQ_CST)
+
+static void signal_fd(int efd) {
+    uint64_t one = 1;
+    if(write(efd, &one, sizeof one) == -1)
+        ; //Already signalled as much as it takes.
+}
+
+static struct shm *shm_new(struct shm_header *h, uint32_t size, size_t length) {
+    struct shm *s = malloc(sizeof *s);
+    if(s == NULL) {
+        munmap(h, length);
+        return NULL;
+    }
+    s->header = h;
+    s->size = size;
+    s->length = length;
+    s->data[SHM_TX] = (uint8_t *)(h + 1);
+    s->data[SHM_RX] = s->data[SHM_TX] + size;
+    return s;
+}
+
+struct shm *shm_create(int size, int *fd) {
+    struct shm_header *h;
+    uint32_t n = 64;
+    size_t length;
+
+    while(n < (uint32_t)size)
+        n *= 2;
+    length = sizeof *h + 2 * (size_t)n;
+#ifdef __linux__
+    *fd = memfd_create("ncp", MFD_CLOEXEC);
+#else
+    {
+        char name[32];
+        snprintf(name, sizeof name, "/ncp.%d", getpid());
+        *fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        shm_unlink(name);
+    }
+#endif
+    if(*fd == -1)
+        return NULL;
+    if(ftruncate(*fd, length) == -1 ||
+       (h = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0))
+       == MAP_FAILED) {
+        close(*fd);
+        return NULL;
+    }
+    h->size = n;
+    return shm_new(h, n, length);
+}
+
+struct shm *shm_map(int fd) {
+    struct shm_header *h;
+    struct stat st;
+    uint32_t n;
+
+    if(fstat(fd, &st) == -1 || st.st_size < sizeof *h)
+        return NULL;
+    h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(h == MAP_FAILED)
+        return NULL;
+    n = h->size;
+    if(n == 0 || (n & (n - 1)) != 0 || sizeof *h + 2 * (size_t)n > st.st_size) {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    return shm_new(h, n, st.st_size);
+}
+
+void shm_unmap(struct shm *s) {
+    munmap(s->header, s->length);
+    free(s);
+}
+
+// What the consumer may take; never more than the ring holds, whatever
+// the other side has put in the indices.
+static uint32_t used(struct shm *s, struct shm_ring *r) {
+    uint32_t n = LOAD(r->tail) - LOAD(r->head);
+    return n > s->size ? s->size : n;
+}
+
+int shm_length(struct shm *s, int r) {
+    return used(s, &s->header->ring[r]);
+}
+
+int shm_put(struct shm *s, int r, const uint8_t *data, int n, int efd) {
+    struct shm_ring *ring = &s->header->ring[r];
+    uint32_t tail = LOAD(ring->tail), at, m;
+
+    if(n > s->size - used(s, ring))
+        n = s->size - used(s, ring);
+    if(n <= 0)
+        return 0;
+    at = tail & (s->size - 1);
+    m = s->size - at < n ? s->size - at : n;
+    memcpy(s->data[r] + at, data, m);
+    memcpy(s->data[r], data + m, n - m);
+    STORE(ring->tail, tail + n);
+    if(LOAD(ring->want_data) && __atomic_exchange_n(&ring->want_data, 0, __ATOMIC_SEQ_CST))
+        signal_fd(efd);
+    return n;
+}
+
+int shm_get(struct shm *s, int r, uint8_t *data, int n, int efd) {
+    struct shm_ring *ring = &s->header->ring[r];
+    uint32_t head = LOAD(ring->head), at, m;
+
+    if(n > used(s, ring))
+        n = used(s, ring);
+    if(n <= 0)
+        return 0;
+    at = head & (s->size - 1);
+    m = s->size - at < n ? s->size - at : n;
+    if(data != NULL) {
+        memcpy(data, s->data[r] + at, m);
+        memcpy(data + m, s->data[r], n - m);
+    }
+    STORE(ring->head, head + n);
+    if(LOAD(ring->want_room) && __atomic_exchange_n(&ring->want_room, 0, __ATOMIC_SEQ_CST))
+        signal_fd(efd);
+    return n;
+}
+
+void shm_end(struct shm *s, int r, int efd) {
+    struct shm_ring *ring = &s->header->ring[r];
+    if(LOAD(ring->eof))
+        return;
+    STORE(ring->eof, 1);
+    if(LOAD(ring->want_data) && __atomic_exchange_n(&ring->want_data, 0, __ATOMIC_SEQ_CST))
+        signal_fd(efd);
+}
+
+int shm_eof(struct shm *s, int r) {
+    return LOAD(s->header->ring[r].eof) != 0;
+}
+
+int shm_want(struct shm *s, int r, int producer) {
+    struct shm_ring *ring = &s->header->ring[r];
+    if(producer) {
+        STORE(ring->want_room, 1);
+        return used(s, ring) < s->size;
+    }
+    STORE(ring->want_data, 1);
+    return used(s, ring) > 0 || LOAD(ring->eof);
+}
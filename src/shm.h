@@ -0,0 +1,57 @@
+/* Rings of octets in memory shared between an application and the NCP,
+   one for each direction of a connection.    Each ring has one producer
+   and one consumer, and each only moves its own index.    A side that
+   wants to know when the other has moved sets a flag in the ring and
+   then looks again; the other side signals an eventfd if it finds the
+   flag set after moving. */
+
+#include <stdint.h>
+
+#define SHM_TX 0 //From the application to the NCP.
+#define SHM_RX 1 //From the NCP to the application.
+
+struct shm_ring {
+    uint32_t head;      //Octets taken, by the consumer.
+    uint32_t want_data; //Set by the consumer to be told of more.
+    uint8_t pad1[56];
+    uint32_t tail;      //Octets put, by the producer.
+    uint32_t want_room; //Set by the producer to be told of room.
+    uint32_t eof;       //The producer is done.
+    uint8_t pad2[52];
+};
+
+// At the start of the shared memory, followed by the data of the rings.
+struct shm_header {
+    uint32_t size;      //Of each ring, a power of two.
+    uint8_t pad[60];
+    struct shm_ring ring[2];
+};
+
+// Each side's own view, which the other can't change.
+struct shm {
+    struct shm_header *header;
+    uint8_t *data[2];
+    uint32_t size;
+    size_t length;      //Of the mapping.
+};
+
+/* Make the rings in a new memory file, with room for at least size
+   octets each, and return them mapped with the file in fd. */
+extern struct shm *shm_create(int size, int *fd);
+/* Map rings made by shm_create in another process. */
+extern struct shm *shm_map(int fd);
+extern void shm_unmap(struct shm *s);
+/* Octets waiting in a ring. */
+extern int shm_length(struct shm *s, int r);
+/* Put or get up to n octets and return how many, signalling efd if
+   the other side wants to know.    Get throws away what it takes if
+   data is NULL. */
+extern int shm_put(struct shm *s, int r, const uint8_t *data, int n, int efd);
+extern int shm_get(struct shm *s, int r, uint8_t *data, int n, int efd);
+/* The producer puts no more. */
+extern void shm_end(struct shm *s, int r, int efd);
+extern int shm_eof(struct shm *s, int r);
+/* Ask to be told when the other side moves, and return whether it
+   already has: there's room for the producer, or something for the
+   consumer to get or the end. */
+extern int shm_want(struct shm *s, int r, int producer);
@@ -0,0 +1,124 @@
+/* Tests of the NCP daemon which need no IMP and no other NCP.
+
+     ncp.c is compiled into this file, as in bench_ncp.c, so that its static
+     functions can be called directly and messages from the IMP made up.
+     The IMP interface runs as if replaying an empty capture, so frames
+     are built but never sent.    Timers don't run; a test calls what
+     would run when they fire.
+
+     Each test prints its name and ok or FAILED, and the exit status is 1
+     if any failed. */
+
+#define main ncp_main
+#include "ncp.c"
+#undef main
+
+#define HOST 1
+#define LINK 42
+
+static int failures;
+
+static void check(const char *name, int ok) {
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    if(!ok)
+        failures++;
+}
+
+// Whether a CLS for these sockets is waiting to go to the host.
+static int cls_pending(int host, uint32_t lsock, uint32_t rsock) {
+    uint8_t cls[9] = { NCP_CLS, lsock >> 24, lsock >> 16, lsock >> 8, lsock,
+                       rsock >> 24, rsock >> 16, rsock >> 8, rsock };
+    int i;
+    for(i = 0; i + 9 <= commands[host].length; i++) {
+        if(memcmp(commands[host].data + i, cls, 9) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// An open connection to HOST with one message waiting for its RFNM.
+static int open_sending(void) {
+    int i;
+    commands[HOST].length = 0;
+    i = conn_make(HOST, 1002, 2000, 1003, 2001);
+    conn_set_link(i, &connection[i].rcv, LINK);
+    conn_set_link(i, &connection[i].snd, LINK + 1);
+    send_imp(0, IMP_REGULAR, HOST, LINK + 1, 0, 0, NULL, 2 + 53);
+    return i;
+}
+
+// The RFNM for the message doesn't come, however often it is sent.
+static void rfnms_time_out(void) {
+    int k;
+    for(k = 0; k <= RETRIES; k++)
+        rfnm_timeout(HOST << 8 | (LINK + 1));
+}
+
+static void test_close_rfnm_timeout(void) {
+    int i = open_sending();
+    close_connection(i, CLS_TIMEOUT);
+    check("close waits for the queue", !cls_pending(HOST, 1003, 2001));
+    rfnms_time_out();
+    check("close after RFNM timeouts", cls_pending(HOST, 1003, 2001) &&
+          !connection[i].closing);
+    destroy(i);
+}
+
+static void test_close_host_dead(void) {
+    uint8_t dead[4] = { IMP_DEAD, HOST, LINK + 1, 1 };
+    int i = open_sending();
+    close_connection(i, CLS_TIMEOUT);
+    process_imp(dead, 2);
+    check("close after host dead", cls_pending(HOST, 1003, 2001) &&
+          !connection[i].closing);
+    destroy(i);
+}
+
+static void test_shut_rfnm_timeout(void) {
+    int i = open_sending();
+    shut_send(i);
+    rfnms_time_out();
+    check("shut down after RFNM timeouts", cls_pending(HOST, 1003, 2001) &&
+          !cls_pending(HOST, 1002, 2000) && !connection[i].closing);
+    destroy(i);
+}
+
+// The hosts given with -H get a RST when the IMP comes up and up to
+// RETRIES more, each a command of one octet.
+static void test_reset_retries(void) {
+    commands[HOST].length = 0;
+    reset_list[0] = HOST;
+    reset_count = 1;
+    ncp_imp_ready(1);
+    while(reset_timer != 0)
+        reset_timeout(0);
+    check("reset retries", commands[HOST].length == 1 + RETRIES);
+    reset_count = 0;
+}
+
+static void setup(void) {
+    char path[] = "/tmp/test_ncp.XXXXXX";
+    int f;
+
+    log_option("none");
+    f = mkstemp(path);
+    if(f == -1 || write(f, "H316CAP1", 8) != 8) { //A capture, see imp.c.
+        perror("test_ncp");
+        exit(1);
+    }
+    close(f);
+    imp_replay(path, 0);
+    unlink(path);
+    rfnm_wait = 1;
+    conn_init();
+    memset(packet, 0, sizeof packet);
+}
+
+int main(int argc, char **argv) {
+    setup();
+    test_close_rfnm_timeout();
+    test_close_host_dead();
+    test_shut_rfnm_timeout();
+    test_reset_retries();
+    return failures != 0;
+}
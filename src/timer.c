@@ -0,0 +1,195 @@
+/* Hierarchical timer wheel with millisecond ticks.    Each level has 64
+     slots, and each slot of a level spans a whole turn of the level
+     below it.    Starting and stopping a timer takes constant time; a
+     timer in a higher level is moved down as its slot comes up. */
+
+#include <time.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "timer.h"
+
+#define BITS 6
+#define SLOTS (1 << BITS)
+#define LEVELS 4
+#define SPAN ((uint64_t)1 << (BITS * LEVELS)) //Ticks covered by the wheel.
+
+#define TIMERS 64 //Initial table size.
+
+struct timer {
+    uint64_t expires;
+    void (*handler)(int arg);
+    int arg;
+    int next, prev; //Slot list, or free list.
+    int *slot;      //Head of the list the timer is on, NULL if free.
+};
+
+static struct timer *timer;
+static int timers, timer_free = -1, active;
+static int wheel[LEVELS][SLOTS];
+static uint64_t current; //Time of the last tick run.
+
+uint64_t timer_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void grow(void) {
+    struct timer *table;
+    int i, n;
+
+    n = timers == 0 ? TIMERS : 2 * timers;
+    table = realloc(timer, n * sizeof *table);
+    if(table == NULL) {
+        LOG(LOG_NCP, LOG_ERROR, "NCP: Out of memory.\n");
+        exit(1);
+    }
+    timer = table;
+    if(timers == 0) {
+        int *p = &wheel[0][0];
+        for(i = 0; i < LEVELS * SLOTS; i++)
+            p[i] = -1;
+        current = timer_now();
+    }
+    for(i = n - 1; i >= timers; i--) {
+        timer[i].slot = NULL;
+        timer[i].next = timer_free;
+        timer_free = i;
+    }
+    timers = n;
+}
+
+static void insert(int i) {
+    uint64_t delta, expires = timer[i].expires;
+    int level;
+
+    // Moving down from a higher level, it may be due right now.    The
+    // slot for the current tick hasn't run yet when that happens.
+    if(expires < current)
+        expires = current;
+    delta = expires - current;
+    if(delta >= SPAN) {
+        // Park it in the last slot; it's moved again when that comes up.
+        delta = SPAN - 1;
+        expires = current + delta;
+    }
+    for(level = 0; level < LEVELS - 1; level++) {
+        if(delta < (uint64_t)1 << (BITS * (level + 1)))
+            break;
+    }
+    timer[i].slot = &wheel[level][(expires >> (BITS * level)) & (SLOTS - 1)];
+    timer[i].prev = -1;
+    timer[i].next = *timer[i].slot;
+    if(timer[i].next != -1)
+        timer[timer[i].next].prev = i;
+    *timer[i].slot = i;
+}
+
+static void unlink_timer(int i) {
+    if(timer[i].prev == -1)
+        *timer[i].slot = timer[i].next;
+    else
+        timer[timer[i].prev].next = timer[i].next;
+    if(timer[i].next != -1)
+        timer[timer[i].next].prev = timer[i].prev;
+}
+
+static void release(int i) {
+    timer[i].slot = NULL;
+    timer[i].next = timer_free;
+    timer_free = i;
+    active--;
+}
+
+int timer_start(unsigned ms, void (*handler)(int arg), int arg) {
+    int i;
+
+    if(timer_free == -1)
+        grow();
+    i = timer_free;
+    timer_free = timer[i].next;
+    active++;
+
+    timer[i].expires = current + (ms == 0 ? 1 : ms);
+    timer[i].handler = handler;
+    timer[i].arg = arg;
+    insert(i);
+    return i + 1;
+}
+
+void timer_stop(int id) {
+    int i = id - 1;
+    if(id <= 0 || i >= timers || timer[i].slot == NULL)
+        return;
+    unlink_timer(i);
+    release(i);
+}
+
+// Milliseconds until the wheel next needs to run, or -1 if no timer
+// is running.    That's the next expiry on the lowest level, or the next
+// time a timer moves down from a higher level.
+int timer_next(void) {
+    uint64_t next = 0, when, now;
+    int level, i, d;
+
+    if(active == 0)
+        return -1;
+    for(level = 0; level < LEVELS; level++) {
+        i = (current >> (BITS * level)) & (SLOTS - 1);
+        for(d = 1; d <= SLOTS; d++) {
+            if(wheel[level][(i + d) & (SLOTS - 1)] != -1)
+                break;
+        }
+        if(d > SLOTS)
+            continue;
+        when = ((current >> (BITS * level)) + d) << (BITS * level);
+        if(next == 0 || when < next)
+            next = when;
+    }
+    now = timer_now();
+    if(next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+static void cascade(int level) {
+    int i, *slot = &wheel[level][(current >> (BITS * level)) & (SLOTS - 1)];
+    while((i = *slot) != -1) {
+        unlink_timer(i);
+        insert(i);
+    }
+}
+
+static void tick(void) {
+    int i, level, *slot;
+
+    current++;
+    for(level = 1; level < LEVELS; level++) {
+        if((current & (((uint64_t)1 << (BITS * level)) - 1)) != 0)
+            break;
+        cascade(level);
+    }
+    slot = &wheel[0][current & (SLOTS - 1)];
+    while((i = *slot) != -1) {
+        unlink_timer(i);
+        if(timer[i].expires > current) {
+            insert(i);
+            continue;
+        }
+        release(i);
+        timer[i].handler(timer[i].arg);
+    }
+}
+
+// Call the handlers of all timers expired by now.
+void timer_run(uint64_t now) {
+    if(active == 0) {
+        if(now > current)
+            current = now;
+        return;
+    }
+    while(current < now)
+        tick();
+}
@@ -0,0 +1,12 @@
+/* Timers for the NCP daemon. */
+
+#include <stdint.h>
+
+/* Timers are numbered from 1; 0 means no timer.    A handler is called
+   with the argument given to timer_start, after the timer is freed. */
+
+extern uint64_t timer_now(void);
+extern int timer_start(unsigned ms, void (*handler)(int arg), int arg);
+extern void timer_stop(int id);
+extern int timer_next(void);
+extern void timer_run(uint64_t now);
@@ -7,23 +7,78 @@
 #define WIRE_WRITE 9
 #define WIRE_INTERRUPT 11
 #define WIRE_CLOSE 13
+#define WIRE_STREAM 15
+#define WIRE_MAP 17
+#define WIRE_BATCH 19
+
+/* Each request has its type, then an id chosen by the application, then
+   a timeout in milliseconds, then its parameters.    The reply has the
+   type plus one and the same id, then its results; an application may
+   have many requests outstanding and the replies come in any order.
+   Numbers are most significant octet first.    A request which isn't
+   done when the timeout runs out gets a reply saying so; 0 means the NCP
+   waits as long as it normally would. */
+#define WIRE_ID_SIZE 4
+#define WIRE_TIMEOUT_SIZE 4
+
+/* Most data carried by one WIRE_WRITE request or WIRE_READ reply; a
+   WIRE_READ asks for up to this many octets, in two octets. */
+#define WIRE_DATA 8192
+#define WIRE_SIZE (3 + WIRE_ID_SIZE + WIRE_TIMEOUT_SIZE + WIRE_DATA)
+
+/* An echo reply has error 0x10 for success, the subtype of a host dead
+   message from the IMP, WIRE_ECHO_TIMEOUT, or WIRE_ECHO_FAILED when the
+   NCP can't take more echoes. */
+#define WIRE_ECHO_TIMEOUT 0x20
+#define WIRE_ECHO_FAILED 0x21
+
+/* Connection numbers are 16 bits, most significant octet first.
+   Connection 0xFFFF in a reply means the request failed, and 0xFFFE that
+   it timed out.    A connection has at most one read and one write
+   outstanding at a time.
+
+   The reply to WIRE_STREAM passes the application one end of a stream
+   socket, with SCM_RIGHTS.    From then on the data of the connection
+   goes through it instead of WIRE_READ and WIRE_WRITE.    Shutting it
+   down for writing keeps the connection open for reading; closing it
+   closes the connection.
+
+   The reply to WIRE_MAP passes a memory file with the rings of shm.h,
+   an eventfd the NCP signals the application with, and one for the
+   other way, in that order.    From then on the data of the connection
+   goes through the rings.    Ending the ring to the NCP closes our side
+   of the connection, and WIRE_CLOSE sends what is left in it first.
+
+   A WIRE_BATCH request has the requests of a batch as its parameters,
+   each with its own id and timeout and preceded by its length in two
+   octets.    The replies to those requests which are done at once go
+   back together in the same way, in a WIRE_BATCH+1 with the id of the
+   batch, or in as few of them as they fit in.    The others are answered
+   on their own, as usual.    WIRE_STREAM, WIRE_MAP and WIRE_BATCH can't
+   be batched, and fail with connection 0xFFFF if they are. */
 
 static int wire_check(int type, int size) {
     switch (type) {
-        case WIRE_ECHO: return size == 3;
-        case WIRE_ECHO+1: return size == 4;
-        case WIRE_OPEN: return size == 6;
-        case WIRE_OPEN+1: return size == 7;
-        case WIRE_LISTEN: return size == 5;
-        case WIRE_LISTEN+1: return size == 7;
-        case WIRE_READ: return size == 3;
-        case WIRE_READ+1: return 1;
-        case WIRE_WRITE: return 1;
-        case WIRE_WRITE+1: return size == 2;
-        case WIRE_INTERRUPT: return size == 2;
-        case WIRE_INTERRUPT+1: return size == 2;
-        case WIRE_CLOSE: return size == 2;
-        case WIRE_CLOSE+1: return size == 2;
+        case WIRE_ECHO: return size == 11;
+        case WIRE_ECHO+1: return size == 8;
+        case WIRE_OPEN: return size == 14;
+        case WIRE_OPEN+1: return size == 12;
+        case WIRE_LISTEN: return size == 13;
+        case WIRE_LISTEN+1: return size == 12;
+        case WIRE_READ: return size == 13;
+        case WIRE_READ+1: return size >= 7;
+        case WIRE_WRITE: return size >= 11;
+        case WIRE_WRITE+1: return size == 7;
+        case WIRE_INTERRUPT: return size == 11;
+        case WIRE_INTERRUPT+1: return size == 7;
+        case WIRE_CLOSE: return size == 11;
+        case WIRE_CLOSE+1: return size == 7;
+        case WIRE_STREAM: return size == 11;
+        case WIRE_STREAM+1: return size == 7;
+        case WIRE_MAP: return size == 11;
+        case WIRE_MAP+1: return size == 7;
+        case WIRE_BATCH: return size >= 9;
+        case WIRE_BATCH+1: return size >= 5;
         default: return 0;
     }
 }